@@ -19,20 +19,38 @@
 #ifndef itkStructurePreservingColorNormalizationFilter_h
 #define itkStructurePreservingColorNormalizationFilter_h
 
+#include <atomic>
 #include <type_traits>
+#include <vector>
 #include "itkRGBPixel.h"
 #include "itkRGBAPixel.h"
 #include "itkVector.h"
 #include "itkCovariantVector.h"
-#include "itkImageToImageFilter.h"
+#include "itkInPlaceImageFilter.h"
 #include "itkImageRegionIterator.h"
 #include "itkImageRegionConstIterator.h"
+#include "itkImageRegionSplitterSlowDimension.h"
 #include "itkSmartPointer.h"
+#include "itkTimeProbe.h"
+#include "itkStructurePreservingColorNormalizationModelCache.h"
+#include "itkStructurePreservingColorNormalizationStainModel.h"
+#include "StructurePreservingColorNormalizationExport.h"
 #include "itkeigen/Eigen/Core"
 
 namespace itk
 {
 
+/** \class StructurePreservingColorNormalizationStatisticsEvent
+ *
+ * \brief Invoked by StructurePreservingColorNormalizationFilter at the
+ * end of an update when MeasurePhases is on, once the statistics
+ * returned by GetPhaseStatistics are complete.
+ *
+ * \ingroup StructurePreservingColorNormalization
+ */
+itkEventMacroDeclarationWithExport( StructurePreservingColorNormalizationStatisticsEvent, AnyEvent,
+  StructurePreservingColorNormalization_EXPORT );
+
 /** \class StructurePreservingColorNormalizationFilter
  *
  * \brief This filter performs "Structure Preserving Color
@@ -67,38 +85,67 @@ namespace itk
  * transforming it to the problem of finding a convex hull for a set
  * of points in a cloud.
  *
+ * The stain estimates are made before the output is produced, with a
+ * pass over each image that needs one.  That pass requests its image
+ * in pieces, as set by NumberOfStreamDivisions and
+ * MaximumNumberOfPixelsPerStreamDivision, and the output pass requests
+ * only the part of the image to be normalized that corresponds to the
+ * output requested region, so that a streaming pipeline need never
+ * hold either image in memory all at once.  The sampling pass and the
+ * factorization report progress and stop promptly when the update is
+ * aborted, as does the output pass, which reports the rest.
+ *
+ * The computations are carried out in TCalcElement, which defaults
+ * to double.  With float, the computations take half the memory and
+ * twice as many values fit in each SIMD register; for 8-bit and
+ * 16-bit pixel values the output rarely differs from that with
+ * double, and then by one intensity level.
+ *
+ * With InPlaceOn, the output is written over the buffer of the image
+ * to be normalized, which is then released, so that only one image's
+ * worth of pixels is held.  Each pixel's values are read before its
+ * normalized values are written, so this is safe for every pixel
+ * type, including RGBAPixel, whose alpha values stay where they are.
+ * It defaults to off.
+ *
  * \ingroup StructurePreservingColorNormalization
  *
  */
-template< typename TImage >
-class StructurePreservingColorNormalizationFilter : public ImageToImageFilter< TImage, TImage >
+template< typename TImage, typename TCalcElement = double >
+class StructurePreservingColorNormalizationFilter : public InPlaceImageFilter< TImage, TImage >
 {
 public:
   ITK_DISALLOW_COPY_AND_ASSIGN( StructurePreservingColorNormalizationFilter );
 
   /** Specific class typedefs */
   using ImageType = TImage;
+  using ImagePointer = typename ImageType::Pointer;
   using RegionType = typename ImageType::RegionType;
+  using IndexType = typename ImageType::IndexType;
+  using IndexValueType = typename IndexType::IndexValueType;
   using RegionConstIterator = ImageRegionConstIterator< ImageType >;
   using RegionIterator = ImageRegionIterator< ImageType >;
   using SizeType = Size< ImageType::ImageDimension >;
   using SizeValueType = typename SizeType::SizeValueType;
   using PixelType = typename ImageType::PixelType;
 
-  using CalcElementType = double;
+  using CalcElementType = TCalcElement;
   using CalcMatrixType = Eigen::Matrix< CalcElementType, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor >;
+  using CalcMatrixConstRefType = Eigen::Ref< const CalcMatrixType >;
   using CalcColVectorType = Eigen::Matrix< CalcElementType, Eigen::Dynamic, 1 >;
   using CalcRowVectorType = Eigen::Matrix< CalcElementType, 1, Eigen::Dynamic >;
+  using CalcColumnArrayType = Eigen::Array< CalcElementType, Eigen::Dynamic, Eigen::Dynamic, Eigen::ColMajor >;
   using CalcUnaryFunctionPointer = CalcElementType ( * ) ( CalcElementType );
+  using StainModelType = StructurePreservingColorNormalizationStainModel;
 
   /** Standard class typedefs. */
-  using Self = StructurePreservingColorNormalizationFilter< ImageType >;
-  using Superclass = ImageToImageFilter< ImageType, ImageType >;
+  using Self = StructurePreservingColorNormalizationFilter< ImageType, CalcElementType >;
+  using Superclass = InPlaceImageFilter< ImageType, ImageType >;
   using Pointer = SmartPointer< Self >;
   using ConstPointer = SmartPointer< const Self >;
 
   /** Run-time type information. */
-  itkTypeMacro( StructurePreservingColorNormalizationFilter, ImageToImageFilter );
+  itkTypeMacro( StructurePreservingColorNormalizationFilter, InPlaceImageFilter );
 
   /** Standard New macro. */
   itkNewMacro( Self );
@@ -119,6 +166,307 @@ public:
   itkGetMacro( ColorIndexSuppressedByEosin, Eigen::Index )
   itkSetMacro( ColorIndexSuppressedByEosin, Eigen::Index )
 
+  /** When an image is read to estimate its stains, it is requested
+   * in at least NumberOfStreamDivisions pieces, and in more if that
+   * is needed for no piece to have more than
+   * MaximumNumberOfPixelsPerStreamDivision pixels.  They default to 1
+   * and 2^24, so an image of up to 2^24 pixels is read whole and a
+   * larger one, such as a whole slide, is never buffered all at once. */
+  itkGetMacro( NumberOfStreamDivisions, unsigned int )
+  itkSetClampMacro( NumberOfStreamDivisions, unsigned int, 1, NumericTraits< unsigned int >::max() )
+  itkGetMacro( MaximumNumberOfPixelsPerStreamDivision, SizeValueType )
+  itkSetClampMacro( MaximumNumberOfPixelsPerStreamDivision, SizeValueType, 1, NumericTraits< SizeValueType >::max() )
+
+  /** When RandomAccessSampling is on, the pixels used to estimate an
+   * image's stains are chosen one per cell of a jittered grid over
+   * the pixel offsets, and only those pixels are read from the
+   * buffer, so that the estimate costs time proportional to the
+   * number of samples rather than to the number of pixels.  An image
+   * from a streaming source is still requested in pieces; see
+   * NumberOfStreamDivisions.  It defaults to off, which scans
+   * every pixel with selection sampling. */
+  itkGetMacro( RandomAccessSampling, bool )
+  itkSetMacro( RandomAccessSampling, bool )
+  itkBooleanMacro( RandomAccessSampling )
+
+  /** The most pixels of an image that are sampled to estimate its
+   * stains.  An image with more pixels is sampled at random.  It
+   * defaults to 100000; fewer samples, such as 20000 for a 512x512
+   * tile, estimate faster and less precisely. */
+  itkGetMacro( MaximumNumberOfSamples, SizeValueType )
+  itkSetClampMacro( MaximumNumberOfSamples, SizeValueType, 1, NumericTraits< SizeValueType >::max() )
+
+  /** The most iterations of non-negative matrix factorization that
+   * refine the stain estimate from its seed.  It defaults to 0, which
+   * uses the seed as is. */
+  itkGetMacro( MaximumNumberOfIterations, SizeValueType )
+  itkSetMacro( MaximumNumberOfIterations, SizeValueType )
+
+  /** The iterations of non-negative matrix factorization stop early
+   * once no stain quantity changes by this much.  It defaults to
+   * 0.01. */
+  itkGetMacro( ConvergenceThreshold, CalcElementType )
+  itkSetClampMacro( ConvergenceThreshold, CalcElementType, CalcElementType( 0.0 ), NumericTraits< CalcElementType >::max() )
+
+  /** The iterations refine the estimate with hierarchical alternating
+   * least squares, which updates one stain at a time in closed form,
+   * reads the samples once per iteration, and typically converges in
+   * a few tens of iterations.  When UseMultiplicativeUpdates is on,
+   * they instead use Virtanen's multiplicative updates, which need
+   * many more iterations.  It defaults to off. */
+  itkGetMacro( UseMultiplicativeUpdates, bool )
+  itkSetMacro( UseMultiplicativeUpdates, bool )
+  itkBooleanMacro( UseMultiplicativeUpdates )
+
+  /** Once the stain models are known, the transform of a pixel
+   * depends only upon its colors.  When UseColorLookupTable is on and
+   * CanUseColorLookupTable is true, the transform is computed, in
+   * parallel, for each color of a ColorLookupTableSize^3 grid, and
+   * each pixel is then looked up rather than transformed.  A size of
+   * 256, the default, tabulates every color, so that the output is
+   * what the transform computes.  A smaller size, such as 33 or 65,
+   * builds much faster and interpolates trilinearly between the grid
+   * colors.  The table is kept until the stain models change, so it
+   * pays off most when they are supplied with SetInputStainModel and
+   * SetReferenceStainModel, as for the tiles of a slide.  It defaults
+   * to off. */
+  itkGetMacro( UseColorLookupTable, bool )
+  itkSetMacro( UseColorLookupTable, bool )
+  itkBooleanMacro( UseColorLookupTable )
+  itkGetMacro( ColorLookupTableSize, unsigned int )
+  itkSetClampMacro( ColorLookupTableSize, unsigned int, 2, 256 )
+
+  /** Much of a slide is unstained glass, whose pixels come out as the
+   * reference's unstained color.  When SkipBackground is on, a pixel
+   * each of whose colors is at least BackgroundThreshold times that
+   * color of the unstained pixel of the image to be normalized is
+   * written as the reference's unstained color without being
+   * transformed.  A threshold of 1.0, the default, skips only pixels
+   * whose stain quantities would be zero, which the transform would
+   * turn into that color anyway; a smaller threshold, such as 0.9, also skips nearly
+   * unstained pixels.  SkipBackground defaults to off.  It is not used
+   * with a color lookup table, whose lookups are already cheap. */
+  itkGetMacro( SkipBackground, bool )
+  itkSetMacro( SkipBackground, bool )
+  itkBooleanMacro( SkipBackground )
+  itkGetMacro( BackgroundThreshold, CalcElementType )
+  itkSetClampMacro( BackgroundThreshold, CalcElementType, CalcElementType( 0.0 ), CalcElementType( 1.0 ) )
+
+  /** Colors at least this fraction as distant as a first pass
+   * distinguisher are good substitutes for it.  It defaults to 0.90. */
+  itkGetMacro( SecondPassDistinguishersThreshold, CalcElementType )
+  itkSetClampMacro( SecondPassDistinguishersThreshold, CalcElementType, CalcElementType( 0.0 ), CalcElementType( 1.0 ) )
+
+  /** Sampled colors that are at least this percentile in brightness
+   * are considered bright.  It defaults to 0.80. */
+  itkGetMacro( BrightPercentileLevel, CalcElementType )
+  itkSetClampMacro( BrightPercentileLevel, CalcElementType, CalcElementType( 0.0 ), CalcElementType( 1.0 ) )
+
+  /** Sampled colors that are at least this fraction of the brightest
+   * sample's brightness are considered bright.  It defaults to
+   * 0.50. */
+  itkGetMacro( BrightPercentageLevel, CalcElementType )
+  itkSetClampMacro( BrightPercentageLevel, CalcElementType, CalcElementType( 0.0 ), CalcElementType( 1.0 ) )
+
+  /** The intensity of each stain is normalized by the dark pixels at
+   * this percentile of brightness.  It defaults to 0.01. */
+  itkGetMacro( VeryDarkPercentileLevel, CalcElementType )
+  itkSetClampMacro( VeryDarkPercentileLevel, CalcElementType, CalcElementType( 0.0 ), CalcElementType( 1.0 ) )
+
+  /** When UseSharedReferenceCache is on, the reference stain model is
+   * looked up in, and added to, the process-wide
+   * StructurePreservingColorNormalizationModelCache, so that filters
+   * in other threads that are given the same reference image and
+   * estimation parameters estimate it only once among them.  The key
+   * is a hash of the reference image's samples, which are all that
+   * the estimate depends upon, together with the estimation
+   * parameters, so each filter still makes its sampling pass.  It
+   * defaults to off. */
+  itkGetMacro( UseSharedReferenceCache, bool )
+  itkSetMacro( UseSharedReferenceCache, bool )
+  itkBooleanMacro( UseSharedReferenceCache )
+
+  /** The wall-clock seconds that the most recent update spent
+   * estimating the stains of the image to be normalized and of the
+   * reference image, each including its sampling pass.  The two
+   * estimations from the samples run concurrently, so the times can
+   * overlap.  A time is zero when a cached estimate was used, which
+   * happens for either image when it is the same image as in the
+   * previous update and its content has not been modified since. */
+  itkGetMacro( InputEstimationTime, double )
+  itkGetMacro( ReferenceEstimationTime, double )
+
+  /** The number of iterations of non-negative matrix factorization
+   * that the most recent update ran for the image to be normalized
+   * and for the reference image.  A number is zero when a cached
+   * estimate was used, including one from the shared reference
+   * cache. */
+  itkGetMacro( InputNumberOfIterations, SizeValueType )
+  itkGetMacro( ReferenceNumberOfIterations, SizeValueType )
+
+  /** The number of pixels that the most recent update, or call to
+   * NormalizeBatch, wrote as background without transforming them.
+   * See SkipBackground. */
+  SizeValueType GetNumberOfBackgroundPixels() const { return m_NumberOfBackgroundPixels; }
+
+  /** What the estimate of one image's stains cost.  The times are
+   * wall-clock seconds.  When the estimate was cached or supplied as a
+   * stain model, cached is true and the rest are zero, except that an
+   * estimate from the shared reference cache has its samples. */
+  struct EstimationStatistics
+    {
+    bool cached {false};
+    double samplingTime {0.0};        // ImageToMatrix
+    double distinguishersTime {0.0};  // MatrixToDistinguishers
+    double factorizationTime {0.0};   // non-negative matrix factorization
+    double normalizationTime {0.0};   // NormalizeMatrixH
+    SizeValueType numberOfSamples {0};
+    SizeValueType numberOfBrightSamples {0};
+    SizeValueType numberOfDarkSamples {0};
+    SizeValueType sampleBytes {0};
+    SizeValueType numberOfIterations {0};
+    };
+
+  /** What the phases of an update cost. */
+  struct PhaseStatistics
+    {
+    EstimationStatistics input;
+    EstimationStatistics reference;
+    bool colorLookupTableCached {false};
+    double colorLookupTableTime {0.0};
+    double pixelPassTime {0.0};
+    SizeValueType numberOfBackgroundPixels {0};
+    };
+
+  /** When MeasurePhases is on, each update times each phase of each
+   * stain estimate and the pixel pass, and counts what they did, for
+   * GetPhaseStatistics.  At the end of the update, it invokes a
+   * StructurePreservingColorNormalizationStatisticsEvent.  It defaults
+   * to off. */
+  itkGetMacro( MeasurePhases, bool )
+  itkSetMacro( MeasurePhases, bool )
+  itkBooleanMacro( MeasurePhases )
+
+  /** The statistics of the most recent update with MeasurePhases on. */
+  const PhaseStatistics &GetPhaseStatistics() const { return m_PhaseStatistics; }
+
+  /** The stain model of the image to be normalized, as estimated by
+   * the most recent update or as supplied with SetInputStainModel. */
+  StainModelType GetInputStainModel() const;
+
+  /** Use this stain model in place of an estimate from the image to
+   * be normalized.  For a whole-slide image, estimate the model once
+   * with EstimateStainModel, from the whole slide or from a level of
+   * its pyramid, and set it here before normalizing tiles of the
+   * slide, so that each tile needs no estimate of its own and all
+   * tiles are normalized alike, without color differences at their
+   * seams.  It is used until ClearInputStainModel is called. */
+  void SetInputStainModel( const StainModelType &model );
+  void ClearInputStainModel();
+
+  /** Estimate the stain model of an image, which need not be an
+   * input of this filter.  The image is read in pieces, as set by
+   * NumberOfStreamDivisions, so a streaming source for a whole slide
+   * is never held in memory all at once. */
+  StainModelType EstimateStainModel( ImageType *image );
+
+  /** The stain model of the reference, as estimated from the
+   * reference image by the most recent update or as supplied with
+   * SetReferenceStainModel. */
+  StainModelType GetReferenceStainModel() const;
+
+  /** Use this stain model, typically one fetched from another filter
+   * with GetReferenceStainModel and saved with WriteJSON, in place of
+   * a reference image.  Input image #1 is then ignored, and need not
+   * be supplied, until ClearReferenceStainModel is called. */
+  void SetReferenceStainModel( const StainModelType &model );
+  void ClearReferenceStainModel();
+
+  /** Normalize each image of a batch, such as the tiles of a slide,
+   * to the reference, and return a new image for each, in order.  The
+   * reference stain model is the one supplied with
+   * SetReferenceStainModel, the cached one, or else is estimated once
+   * from input image #1.  If an input stain model was supplied with
+   * SetInputStainModel then it is used for every image.  Each image of the batch must be distinct
+   * and entirely in memory; its stains are estimated and its pixels
+   * are transformed by a single work unit, and the work units take
+   * the images one at a time as they become free.  With InPlaceOn,
+   * each image is overwritten with its normalized pixels and is
+   * itself returned.  This bypasses the pipeline, and input image #0
+   * and the output are not used. */
+  std::vector< ImagePointer > NormalizeBatch( const std::vector< ImagePointer > &inputImages );
+
+  /** Normalize each image of a batch, as does the other NormalizeBatch,
+   * but into the corresponding image of outputImages, which the
+   * caller has allocated, entirely in memory, with the same largest
+   * possible region as its input image.  An output image may be its
+   * input image, but not another image of the batch.  This suits
+   * outputs that are views of memory that the caller owns. */
+  void NormalizeBatch( const std::vector< ImagePointer > &inputImages, const std::vector< ImagePointer > &outputImages );
+
+  /** Normalize the tiles that are stacked along the slowest varying
+   * dimension of inputTiles, each as its own image of a batch, into
+   * the same places in outputTiles, which may be inputTiles.  Both
+   * images need to be entirely in memory with the same largest
+   * possible region, and the size of its slowest varying dimension
+   * needs to be a multiple of numberOfTiles.  The tiles are read and
+   * written where they are, so from Python a C-contiguous NumPy array
+   * of N tiles, each H x W x 3, and an output array like it can each
+   * be viewed with itk.image_view_from_array as one ( N * H ) x W
+   * image and the whole stack normalized, without copying, in one
+   * call. */
+  void NormalizeTiles( const ImageType *inputTiles, ImageType *outputTiles, SizeValueType numberOfTiles );
+
+  /** The stain models as JSON documents, in the form that
+   * StainModelType::WriteJSON writes, for languages such as Python
+   * that the stain model class is not wrapped for. */
+  std::string GetInputStainModelJSON() const;
+  std::string GetReferenceStainModelJSON() const;
+  void SetInputStainModelJSON( const std::string &json );
+  void SetReferenceStainModelJSON( const std::string &json );
+
+  /** The per-pixel transform, once the stain models are known, as
+   * plain arrays that another implementation of the transform, such
+   * as a GPU kernel, can upload once and then apply to every pixel of
+   * a slide.  With C = numberOfColors and S = numberOfStains, the
+   * matrices are stored row major: inputHTranspose is C x S, indexed
+   * by color and then stain; inputHHTransposeInverse is S x S,
+   * indexed by stain and then stain; and referenceH is S x C, indexed
+   * by stain and then color.  The other arrays have one entry per
+   * color.  A pixel whose colors are v is transformed as
+   *
+   *   d[c] = logInputUnstained[c] - log( v[c] )
+   *   p[s] = max( sum_c d[c] * inputHTranspose[c * S + s] - lambda, 0 )
+   *   w[s] = max( sum_t p[t] * inputHHTransposeInverse[t * S + s], 0 )
+   *   y[c] = logReferenceUnstained[c] - sum_s w[s] * referenceH[s * C + c]
+   *   out[c] = min( max( exp( y[c] ) - 1, lowerbound ), upperbound )
+   *
+   * and out[c] is then truncated to PixelValueType; any dimension past
+   * the colors, such as alpha, is copied.  When skipBackground is
+   * true, a pixel with v[c] >= backgroundLowerbound[c] for every color
+   * is instead written as backgroundPixel. */
+  struct PixelTransformCoefficients
+    {
+    SizeValueType numberOfColors {0};
+    SizeValueType numberOfStains {0};
+    std::vector< CalcElementType > inputHTranspose;          // C x S, [c * S + s]
+    std::vector< CalcElementType > inputHHTransposeInverse;  // S x S, [t * S + s]
+    std::vector< CalcElementType > referenceH;               // S x C, [s * C + c]
+    std::vector< CalcElementType > logInputUnstained;        // C
+    std::vector< CalcElementType > logReferenceUnstained;    // C
+    CalcElementType lowerbound {0};
+    CalcElementType upperbound {0};
+    bool skipBackground {false};
+    std::vector< CalcElementType > backgroundLowerbound;     // C
+    std::vector< CalcElementType > backgroundPixel;          // C
+    };
+
+  /** The coefficients of the transform from GetInputStainModel to
+   * GetReferenceStainModel, which are known after an update, or once
+   * both stain models have been supplied.  The arrays are empty while
+   * either stain model is not known. */
+  PixelTransformCoefficients GetPixelTransformCoefficients() const;
+
   // This algorithm is defined for H&E (Hematoxylin (blue) and
   // Eosin (pink)), which is a total of 2 stains.  However, this
   // approach could in theory work in other circumstances.  In that
@@ -127,20 +475,12 @@ public:
 
   /** Hematoxylin and eosin; there are two stains supported. */
   static constexpr SizeValueType NumberOfStains {2};
-  /** For Virtanen's non-negative matrix factorization algorithm. */
-  static constexpr SizeValueType maxNumberOfIterations {0};
-  /** Select a subset of the pixels if the image has more than this */
-  static constexpr SizeValueType maxNumberOfRows {100000};
-  /** Colors at least this fraction as distance as first pass distinguisher are good substitutes for it. */
-  static constexpr CalcElementType SecondPassDistinguishersThreshold {0.90};
-  /** Colors that are at least this percentile in brightness are considered bright. */
-  static constexpr CalcElementType BrightPercentileLevel {0.80};
-  /** Colors that are at least fraction of white's brightness are considered bright. */
-  static constexpr CalcElementType BrightPercentageLevel {0.50};
-  /** Intensity normalization of an image is based upon dark pixels of this percentil brightness. */
-  static constexpr CalcElementType VeryDarkPercentileLevel {0.01};
-  /** A small matrix.array_inf_norm() value for checking convergence of a matrix */
-  static constexpr CalcElementType epsilon0 {1e-2};
+  /** Transform the pixels of an output region in blocks of at most this many pixels */
+  static constexpr SizeValueType maxNumberOfRowsPerBlock {4096};
+  /** Sample the pixels of an image in parallel, in strata of this many consecutive pixels */
+  static constexpr SizeValueType numberOfPixelsPerStratum {65536};
+  /** Compute from the sampled pixels in parallel, in blocks of this many consecutive rows */
+  static constexpr SizeValueType numberOfSampleRowsPerBlock {16384};
   /** A very small squared magnitude for a vector, to prevent division by zero. */
   static constexpr CalcElementType epsilon2 {1e-12};
   /** The Lasso optimization penalty. */
@@ -161,8 +501,8 @@ protected:
     {
     using PixelType = TPixelType;
     using ValueType = typename PixelType::ValueType;
-    static constexpr SizeValueType NumberOfDimensions = -1;
-    static constexpr SizeValueType NumberOfColors = -1;
+    static constexpr typename Eigen::Index NumberOfDimensions = -1;
+    static constexpr typename Eigen::Index NumberOfColors = -1;
     static constexpr typename Eigen::Index ColorIndexSuppressedByHematoxylin = -1;
     static constexpr typename Eigen::Index ColorIndexSuppressedByEosin = -1;
     static PixelType pixelInstance( unsigned numberOfDimensions ) { return PixelType {numberOfDimensions}; }
@@ -176,8 +516,8 @@ protected:
     {
     using PixelType = TPixelType;
     using ValueType = PixelType;
-    static constexpr SizeValueType NumberOfDimensions = 1;
-    static constexpr SizeValueType NumberOfColors = 1;
+    static constexpr typename Eigen::Index NumberOfDimensions = 1;
+    static constexpr typename Eigen::Index NumberOfColors = 1;
     static constexpr typename Eigen::Index ColorIndexSuppressedByHematoxylin = -1;
     static constexpr typename Eigen::Index ColorIndexSuppressedByEosin = -1;
     static PixelType pixelInstance( unsigned numberOfDimensions ) { return PixelType {}; }
@@ -188,8 +528,8 @@ protected:
     {
     using PixelType = RGBPixel< TScalar >;
     using ValueType = typename PixelType::ValueType;
-    static constexpr SizeValueType NumberOfDimensions = 3;
-    static constexpr SizeValueType NumberOfColors = 3;
+    static constexpr typename Eigen::Index NumberOfDimensions = 3;
+    static constexpr typename Eigen::Index NumberOfColors = 3;
     static constexpr typename Eigen::Index ColorIndexSuppressedByHematoxylin = 0;
     static constexpr typename Eigen::Index ColorIndexSuppressedByEosin = 1;
     static PixelType pixelInstance( unsigned numberOfDimensions ) { return PixelType {}; }
@@ -200,8 +540,8 @@ protected:
     {
     using PixelType = RGBAPixel< TScalar >;
     using ValueType = typename PixelType::ValueType;
-    static constexpr SizeValueType NumberOfDimensions = 4;
-    static constexpr SizeValueType NumberOfColors = 3;
+    static constexpr typename Eigen::Index NumberOfDimensions = 4;
+    static constexpr typename Eigen::Index NumberOfColors = 3;
     static constexpr typename Eigen::Index ColorIndexSuppressedByHematoxylin = 0;
     static constexpr typename Eigen::Index ColorIndexSuppressedByEosin = 1;
     static PixelType pixelInstance( unsigned numberOfDimensions ) { return PixelType {}; }
@@ -215,8 +555,8 @@ protected:
     {
     using PixelType = Vector< TScalar, NVectorDimension >;
     using ValueType = typename PixelType::ValueType;
-    static constexpr SizeValueType NumberOfDimensions = NVectorDimension;
-    static constexpr SizeValueType NumberOfColors = NVectorDimension;
+    static constexpr typename Eigen::Index NumberOfDimensions = NVectorDimension;
+    static constexpr typename Eigen::Index NumberOfColors = NVectorDimension;
     static constexpr typename Eigen::Index ColorIndexSuppressedByHematoxylin = -1;
     static constexpr typename Eigen::Index ColorIndexSuppressedByEosin = -1;
     static PixelType pixelInstance( unsigned numberOfDimensions ) { return PixelType {}; }
@@ -226,8 +566,8 @@ protected:
     {
     using PixelType = CovariantVector< TScalar, NVectorDimension >;
     using ValueType = typename PixelType::ValueType;
-    static constexpr SizeValueType NumberOfDimensions = NVectorDimension;
-    static constexpr SizeValueType NumberOfColors = NVectorDimension;
+    static constexpr typename Eigen::Index NumberOfDimensions = NVectorDimension;
+    static constexpr typename Eigen::Index NumberOfColors = NVectorDimension;
     static constexpr typename Eigen::Index ColorIndexSuppressedByHematoxylin = -1;
     static constexpr typename Eigen::Index ColorIndexSuppressedByEosin = -1;
     static PixelType pixelInstance( unsigned numberOfDimensions ) { return PixelType {}; }
@@ -239,6 +579,37 @@ public:
   /** Additional specific class typedefs */
   using PixelValueType = typename PixelHelper< PixelType >::ValueType;
 
+  /** For unsigned pixel value types of at most 16 bits, the logarithm
+   * of an input color intensity is looked up in a table rather than
+   * computed for each pixel. */
+  static constexpr bool UseLogLookupTable {std::is_integral< PixelValueType >::value && std::is_unsigned< PixelValueType >::value
+    && sizeof( PixelValueType ) <= 2};
+  /** The width in bytes of the vectors that Eigen computes with, which
+   * is the alignment that it uses for them, or 0 when Eigen does not
+   * vectorize. */
+#ifdef EIGEN_VECTORIZE
+  static constexpr SizeValueType EigenVectorBytes {EIGEN_MAX_ALIGN_BYTES};
+#else
+  static constexpr SizeValueType EigenVectorBytes {0};
+#endif
+  /** For unsigned 8-bit pixel value types, the exponential that
+   * produces an output color intensity is found by a search of a
+   * table rather than computed for each pixel.  For wider types the
+   * table is too large for the search to be faster, and when Eigen
+   * vectorizes at least four CalcElementType values at a time (e.g.,
+   * AVX) its vectorized exponential is faster. */
+  static constexpr bool UseExpLookupTable {UseLogLookupTable && sizeof( PixelValueType ) == 1
+    && EigenVectorBytes < 4 * sizeof( CalcElementType )};
+  /** Otherwise, NMFsToImage computes the logarithms and exponentials
+   * with Eigen's vectorized versions, which are within this many units
+   * in the last place of std::log and std::exp. */
+  static constexpr int MaximumVectorizedMathULPs {2};
+  /** A color lookup table is available for pixels of three unsigned
+   * 8-bit colors, such as RGBPixel< unsigned char >, optionally with
+   * additional values, such as alpha, that are passed through. */
+  static constexpr bool CanUseColorLookupTable {PixelHelper< PixelType >::NumberOfColors == 3
+    && std::is_same< PixelValueType, unsigned char >::value};
+
 protected:
 
   StructurePreservingColorNormalizationFilter();
@@ -250,40 +621,215 @@ protected:
 
   void GenerateInputRequestedRegion() override;
 
+  void GenerateData() override;
+
   void BeforeThreadedGenerateData() override;
 
   void DynamicThreadedGenerateData( const RegionType & outputRegion ) override;
 
-  int ImageToNMF( RegionConstIterator &iter, CalcMatrixType &matrixH, CalcRowVectorType &unstainedPixel ) const;
+  void AfterThreadedGenerateData() override;
+
+  void ValidateParameters();
 
-  void ImageToMatrix( RegionConstIterator &iter, SizeValueType numberOfPixels, CalcMatrixType &matrixBrightV, CalcMatrixType &matrixDarkV ) const;
+  void BuildLookupTables();
 
-  static void MatrixToDistinguishers( const CalcMatrixType &matrixV, CalcMatrixType &distinguishers );
+  // Normalizes each input image into its output image, or, where
+  // that is null, into a new image or, with InPlaceOn, the input
+  // image, which is then stored there.
+  void BatchToImages( const std::vector< ImagePointer > &inputImages, std::vector< ImagePointer > &outputImages );
 
-  static void MatrixToMatrixExtremes( const CalcMatrixType &matrixV, CalcMatrixType &matrixBrightV, CalcMatrixType &matrixDarkV );
+  // outputImage may be null; see BatchToImages.
+  ImagePointer BatchImageToImage( const ImageType *inputImage, ImageType *outputImage,
+    SizeValueType &numberOfBackgroundPixels ) const;
 
-  static void FirstPassDistinguishers( const CalcMatrixType &normVStart, std::array< int, NumberOfStains+1 > &firstPassDistinguisherIndices, SizeValueType &numberOfDistinguishers );
+  // An image whose buffer is the part of image's buffer in region,
+  // which is a slab along the slowest varying dimension.
+  static ImagePointer TileView( const ImageType *image, const RegionType &region );
+
+  int ImageToNMF( ImageType *image, CalcMatrixType &matrixH, CalcRowVectorType &unstainedPixel ) const;
+
+  // The sampled pixels of an image, one per row of matrixV.
+  // MatrixToMatrixExtremes arranges the rows so that the bright pixels
+  // and the dark pixels are each consecutive rows, which are then used
+  // in place: rows before firstBrightRow are only dark, rows from
+  // endOfDarkRows on are only bright, and rows in between are both.
+  struct SampleMatrix
+    {
+    CalcMatrixType matrixV;
+    Eigen::Index firstBrightRow;
+    Eigen::Index endOfDarkRows;
+    };
+
+  // Where a stain estimate within an update reports its progress: the
+  // span from start to start + weight of filter's progress.  A null
+  // filter reports nothing, as for an estimate on another thread.
+  // Either way, an estimate given an EstimationProgress throws
+  // ProcessAborted soon after the update is aborted.
+  struct EstimationProgress
+    {
+    ProcessObject *filter;
+    float start;
+    float weight;
+    };
 
-  static void SecondPassDistinguishers( const CalcMatrixType &normVStart, const std::array< int, NumberOfStains+1 > &firstPassDistinguisherIndices, const SizeValueType numberOfDistinguishers,
-    CalcMatrixType &secondPassDistinguisherColors );
+  // Throws ProcessAborted if the update has been aborted.
+  void CheckAbortGenerateData() const;
 
-  static int MatrixToOneDistinguisher( const CalcMatrixType &normV );
+  void ImageToMatrix( ImageType *image, SampleMatrix &samples, bool multithreaded = true,
+    const EstimationProgress *progress = nullptr ) const;
 
-  static CalcMatrixType RecenterMatrix( const CalcMatrixType &normV, const SizeValueType row );
+  // When statistics is supplied, the phases are timed and counted
+  // there.  When multithreaded is false, as for an image of a batch,
+  // the estimate runs on the calling thread alone; otherwise its
+  // parallel steps share one NewEstimationMultiThreader.
+  int MatricesToNMF( const SampleMatrix &samples, CalcMatrixType &matrixH, CalcRowVectorType &unstainedPixel,
+    SizeValueType &numberOfIterations, EstimationStatistics *statistics = nullptr, const EstimationProgress *progress = nullptr,
+    bool multithreaded = true ) const;
+
+  // MatricesToNMF for the reference image's samples, by way of the
+  // shared reference cache when UseSharedReferenceCache is on.
+  int ReferenceMatricesToNMF( const SampleMatrix &samples, CalcMatrixType &matrixH, CalcRowVectorType &unstainedPixel,
+    SizeValueType &numberOfIterations, EstimationStatistics *statistics = nullptr,
+    const EstimationProgress *progress = nullptr ) const;
+
+  static ModifiedTimeType ContentMTime( const ImageType *image );
+
+  // Whether the pixels of region are consecutive in a buffer that
+  // holds bufferedRegion, so that they can be visited with a pointer.
+  static bool IsContiguous( const RegionType &region, const RegionType &bufferedRegion );
+
+  // The address of the first pixel value of the pixel at index, for
+  // both Image and VectorImage.
+  static const PixelValueType *BufferPointer( const ImageType *image, const IndexType &index );
+
+  static PixelValueType *BufferPointer( ImageType *image, const IndexType &index );
+
+  void MatrixToDistinguishers( const CalcMatrixConstRefType &matrixV, CalcMatrixType &distinguishers ) const;
+
+  void MatrixToMatrixExtremes( SampleMatrix &samples ) const;
+
+  static void FirstPassDistinguishers( const CalcMatrixConstRefType &matrixV,
+    std::array< int, NumberOfStains+1 > &firstPassDistinguisherIndices, SizeValueType &numberOfDistinguishers );
+
+  void SecondPassDistinguishers( const CalcMatrixConstRefType &matrixV,
+    const std::array< int, NumberOfStains+1 > &firstPassDistinguisherIndices, const SizeValueType numberOfDistinguishers,
+    CalcMatrixType &secondPassDistinguisherColors ) const;
+
+  // The distinguisher searches recenter the samples at one
+  // distinguisher and project them away from others.  Rather than
+  // transform the whole matrix of samples for each distinguisher,
+  // they keep the transformation as a center, which is subtracted
+  // from each row, and up to NumberOfStains orthonormal directions,
+  // which are then projected away, and transform one row at a time.
+  // numberOfDirections is -1 until the center is set.
+  struct DistinguisherProjection
+    {
+    CalcRowVectorType center;
+    CalcMatrixType directions;
+    Eigen::Index numberOfDirections;
+    };
+
+  static DistinguisherProjection NewDistinguisherProjection( Eigen::Index numberOfColors );
+
+  static void ProjectRow( const CalcMatrixConstRefType &matrixV, const Eigen::Index row,
+    const DistinguisherProjection &projection, CalcRowVectorType &projectedRow );
+
+  static void AddToProjection( const CalcMatrixConstRefType &matrixV, const Eigen::Index row, DistinguisherProjection &projection,
+    CalcRowVectorType &scratchRow );
+
+  static int MatrixToOneDistinguisher( const CalcMatrixConstRefType &matrixV, const DistinguisherProjection &projection,
+    CalcRowVectorType &scratchRow );
+
+  int DistinguishersToNMFSeeds( const CalcMatrixType &distinguishers, CalcRowVectorType &unstainedPixel,
+    CalcMatrixType &matrixH ) const;
+
+  void DistinguishersToColors( const CalcMatrixType &distinguishers, SizeValueType &unstainedIndex,
+    SizeValueType &hematoxylinIndex, SizeValueType &eosinIndex ) const;
+
+  // A multithreader of the kind installed with SetMultiThreader, for
+  // the parallel steps of one estimate.  Each estimate has its own,
+  // because the estimates for the two images of an update run
+  // concurrently.
+  MultiThreaderBase::Pointer NewEstimationMultiThreader() const;
+
+  // Call function( index ) for each index below numberOfIndices, on
+  // the work units of multiThreader, or on this thread alone when
+  // multiThreader is null.
+  void ParallelizeIndices( SizeValueType numberOfIndices, MultiThreaderBase *multiThreader,
+    const MultiThreaderBase::ArrayThreadingFunctorType &function ) const;
+
+  // Call blockFunction( firstRow, numberOfBlockRows ) for each block
+  // of at most numberOfSampleRowsPerBlock consecutive rows of
+  // numberOfRows.  The blocks do not depend upon the number of work
+  // units, so neither does what is computed from them.
+  template< typename TBlockFunction >
+  void ParallelizeSampleRows( Eigen::Index numberOfRows, MultiThreaderBase *multiThreader,
+    const TBlockFunction &blockFunction ) const;
+
+  // matrixW = clip( ( clip( matrixV * matrixH^T - lambda ) + epsilon2 )
+  // * ( matrixH * matrixH^T )^-1 ), the starting point of the
+  // factorizations.  Each row of matrixW depends only upon the same
+  // row of matrixV, so it is computed in blocks of rows.
+  void MatricesToInitialW( const CalcMatrixConstRefType &matrixV, const CalcMatrixType &matrixH, CalcMatrixType &matrixW,
+    MultiThreaderBase *multiThreader ) const;
+
+  void NormalizeMatrixH( const CalcMatrixConstRefType &matrixDarkV, const CalcRowVectorType &unstainedPixel,
+    CalcMatrixType &matrixH, MultiThreaderBase *multiThreader = nullptr ) const;
+
+  SizeValueType HALSNMFEuclidean( const CalcMatrixConstRefType &matrixV, CalcMatrixType &matrixW, CalcMatrixType &matrixH,
+    const EstimationProgress *progress = nullptr, MultiThreaderBase *multiThreader = nullptr ) const;
+
+  SizeValueType VirtanenNMFEuclidean( const CalcMatrixConstRefType &matrixV, CalcMatrixType &matrixW, CalcMatrixType &matrixH,
+    const EstimationProgress *progress = nullptr, MultiThreaderBase *multiThreader = nullptr ) const;
+
+  SizeValueType VirtanenNMFKLDivergence( const CalcMatrixConstRefType &matrixV, CalcMatrixType &matrixW,
+    CalcMatrixType &matrixH ) const;
+
+  // Everything that the per-pixel transform needs that does not
+  // depend upon the pixel.  BeforeThreadedGenerateData computes one
+  // of these for each run, and the threads only read it.
+  struct TransformModel
+    {
+    CalcMatrixType inputHTranspose;          // NumberOfColors x NumberOfStains
+    CalcMatrixType inputHHTransposeInverse;  // NumberOfStains x NumberOfStains
+    CalcMatrixType referenceH;               // NumberOfStains x NumberOfColors
+    CalcRowVectorType logInputUnstained;
+    CalcRowVectorType logReferenceUnstained;
+    CalcElementType lowerbound;
+    CalcElementType upperbound;
+    // When skipBackground is set, a pixel with every color at least
+    // that of backgroundLowerbound is written as backgroundPixel.
+    bool skipBackground;
+    CalcRowVectorType backgroundLowerbound;
+    CalcRowVectorType backgroundPixel;
+    };
 
-  static CalcMatrixType ProjectMatrix( const CalcMatrixType &normV, const SizeValueType row );
+  // The only conversion from a TransformModel to the coefficients
+  // that GetPixelTransformCoefficients exports, so that the exported
+  // transform is the one that the filter applies.
+  static PixelTransformCoefficients TransformModelToCoefficients( const TransformModel &model );
 
-  int DistinguishersToNMFSeeds( const CalcMatrixType &distinguishers, CalcRowVectorType &unstainedPixel, CalcMatrixType &matrixH ) const;
+  static void SynchronizeStains( const CalcMatrixType &inputH, CalcMatrixType &referenceH );
 
-  void DistinguishersToColors( const CalcMatrixType &distinguishers, SizeValueType &unstainedIndex, SizeValueType &hematoxylinIndex, SizeValueType &eosinIndex ) const;
+  void NMFsToTransformModel( const CalcMatrixType &inputH, const CalcRowVectorType &inputUnstained,
+    const CalcMatrixType &referenceH, const CalcRowVectorType &referenceUnstained, TransformModel &model ) const;
 
-  void NormalizeMatrixH( const CalcMatrixType &matrixDarkV, const CalcRowVectorType &unstainedPixel, CalcMatrixType &matrixH ) const;
+  // The pixel transforms return the number of pixels that they wrote
+  // as background.
+  SizeValueType NMFsToImage( const ImageType *inputImage, const TransformModel &model, RegionIterator &outIt ) const;
 
-  static void VirtanenNMFEuclidean( const CalcMatrixType &matrixV, CalcMatrixType &matrixW, CalcMatrixType &matrixH );
+  // Tabulate the transform of model for the grid of colors, unless the
+  // table is already for this grid and model.
+  void BuildColorLookupTable( const TransformModel &model );
 
-  static void VirtanenNMFKLDivergence( const CalcMatrixType &matrixV, CalcMatrixType &matrixW, CalcMatrixType &matrixH );
+  // Transform pixels by looking them up in the color lookup table.
+  void ColorLookupTableToImage( const ImageType *inputImage, RegionIterator &outIt ) const;
 
-  void NMFsToImage( const CalcMatrixType &inputH, const CalcRowVectorType &inputUnstained, const CalcMatrixType &referH, const CalcRowVectorType &referUnstained, RegionIterator &outIt ) const;
+  // Call convertPixel( inputPixelValues, outputPixelValues ) for each
+  // pair of matching pixels, for when the number of dimensions is known
+  // at compile time.
+  template< int VNumberOfDimensions, typename TPixelConverter >
+  void ConvertPixels( const ImageType *inputImage, RegionIterator &outIt, const TPixelConverter &convertPixel ) const;
 
   // Our installation of Eigen3 does not have iterators.  (They
   // arrive with Eigen 3.4.)  We define begin, cbegin, end, and cend
@@ -320,20 +866,72 @@ protected:
 #endif
 
   // These members are for the purpose of caching results for use the
-  // next time the pipeline is run.
+  // next time the pipeline is run.  An image is recognized as
+  // unchanged by its ContentMTime rather than its TimeStamp, because
+  // streaming regenerates the buffered pixels of an unchanged image.
   ModifiedTimeType m_ParametersMTime;
   const ImageType *m_Input;
+  // Zero when m_InputH was not estimated from m_Input.
+  ModifiedTimeType m_InputMTime;
   CalcMatrixType m_InputH;
   CalcRowVectorType m_InputUnstainedPixel;
   const ImageType *m_Reference;
-  TimeStamp m_ReferenceTimeStamp;
+  ModifiedTimeType m_ReferenceMTime;
   CalcMatrixType m_ReferenceH;
   CalcRowVectorType m_ReferenceUnstainedPixel;
+  bool m_UseInputStainModel;
+  StainModelType m_InputStainModel;
+  bool m_UseReferenceStainModel;
+  StainModelType m_ReferenceStainModel;
 
   Eigen::Index m_NumberOfDimensions;
   Eigen::Index m_NumberOfColors;
   Eigen::Index m_ColorIndexSuppressedByHematoxylin;
   Eigen::Index m_ColorIndexSuppressedByEosin;
+  unsigned int m_NumberOfStreamDivisions;
+  SizeValueType m_MaximumNumberOfPixelsPerStreamDivision;
+  bool m_RandomAccessSampling;
+  SizeValueType m_MaximumNumberOfSamples;
+  SizeValueType m_MaximumNumberOfIterations;
+  CalcElementType m_ConvergenceThreshold;
+  CalcElementType m_SecondPassDistinguishersThreshold;
+  CalcElementType m_BrightPercentileLevel;
+  CalcElementType m_BrightPercentageLevel;
+  CalcElementType m_VeryDarkPercentileLevel;
+  bool m_UseMultiplicativeUpdates;
+  bool m_UseSharedReferenceCache;
+  bool m_UseColorLookupTable;
+  unsigned int m_ColorLookupTableSize;
+  bool m_SkipBackground;
+  CalcElementType m_BackgroundThreshold;
+  double m_InputEstimationTime;
+  double m_ReferenceEstimationTime;
+  SizeValueType m_InputNumberOfIterations;
+  SizeValueType m_ReferenceNumberOfIterations;
+  std::atomic< SizeValueType > m_NumberOfBackgroundPixels;
+  bool m_MeasurePhases;
+  PhaseStatistics m_PhaseStatistics;
+  TimeProbe m_PixelPassProbe;
+
+  // m_LogLookupTable[ value ] is the logarithm of a color intensity
+  // value and m_ExpLookupTable[ value ] is the logarithm at which
+  // exponentiation followed by decrementing first reaches value + 1.
+  // See BeforeThreadedGenerateData.
+  std::vector< CalcElementType > m_LogLookupTable;
+  std::vector< CalcElementType > m_ExpLookupTable;
+
+  TransformModel m_TransformModel;
+
+  // m_ColorLookupTable has a pixel for each color of the grid, in the
+  // order of the first color varying slowest, and holds that color as
+  // transformed by m_ColorLookupTableModel.  A color value lies in
+  // grid cell m_ColorLookupTableCell[ value ], at the fraction
+  // m_ColorLookupTableWeight[ value ] of the way across it.  See
+  // BuildColorLookupTable.
+  ImagePointer m_ColorLookupTable;
+  TransformModel m_ColorLookupTableModel;
+  std::vector< SizeValueType > m_ColorLookupTableCell;
+  std::vector< CalcElementType > m_ColorLookupTableWeight;
 
 private:
 
@@ -21,40 +21,541 @@
 
 #include "itkStructurePreservingColorNormalizationFilter.h"
 #include "itkMersenneTwisterRandomVariateGenerator.h"
+#include "itkProgressReporter.h"
+#include "itkProgressTransformer.h"
+#include <atomic>
+#include <exception>
+#include <future>
+#include <mutex>
 #include <numeric>
 
 namespace itk
 {
 
-template< typename TImage >
-StructurePreservingColorNormalizationFilter< TImage >
+template< typename TImage, typename TCalcElement >
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
 ::StructurePreservingColorNormalizationFilter()
-  : m_NumberOfDimensions( Self::PixelHelper< PixelType >::NumberOfDimensions ),
+  : m_ParametersMTime( 0 ),
+    m_Input( nullptr ),
+    m_InputMTime( 0 ),
+    m_Reference( nullptr ),
+    m_ReferenceMTime( 0 ),
+    m_UseInputStainModel( false ),
+    m_UseReferenceStainModel( false ),
+    m_NumberOfDimensions( Self::PixelHelper< PixelType >::NumberOfDimensions ),
     m_NumberOfColors( Self::PixelHelper< PixelType >::NumberOfColors ),
     m_ColorIndexSuppressedByHematoxylin( Self::PixelHelper< PixelType >::ColorIndexSuppressedByHematoxylin ),
-    m_ColorIndexSuppressedByEosin( Self::PixelHelper< PixelType >::ColorIndexSuppressedByEosin )
+    m_ColorIndexSuppressedByEosin( Self::PixelHelper< PixelType >::ColorIndexSuppressedByEosin ),
+    m_NumberOfStreamDivisions( 1 ),
+    m_MaximumNumberOfPixelsPerStreamDivision( SizeValueType {1} << 24 ),
+    m_RandomAccessSampling( false ),
+    m_MaximumNumberOfSamples( 100000 ),
+    m_MaximumNumberOfIterations( 0 ),
+    m_ConvergenceThreshold( 1e-2 ),
+    m_SecondPassDistinguishersThreshold( 0.90 ),
+    m_BrightPercentileLevel( 0.80 ),
+    m_BrightPercentageLevel( 0.50 ),
+    m_VeryDarkPercentileLevel( 0.01 ),
+    m_UseMultiplicativeUpdates( false ),
+    m_UseSharedReferenceCache( false ),
+    m_UseColorLookupTable( false ),
+    m_ColorLookupTableSize( 256 ),
+    m_SkipBackground( false ),
+    m_BackgroundThreshold( 1.0 ),
+    m_InputEstimationTime( 0.0 ),
+    m_ReferenceEstimationTime( 0.0 ),
+    m_InputNumberOfIterations( 0 ),
+    m_ReferenceNumberOfIterations( 0 ),
+    m_NumberOfBackgroundPixels( 0 ),
+    m_MeasurePhases( false )
 {
   // The number of colors had better be at least 3 or be unknown
   // ( which is indicated with the value -1 ).
   static_assert( 2 / PixelHelper< PixelType >::NumberOfColors < 1, "Images need at least 3 colors" );
+  // Pixel buffers are read as arrays of pixel values.
+  static_assert( PixelHelper< PixelType >::NumberOfDimensions < 0
+    || sizeof( PixelType ) == PixelHelper< PixelType >::NumberOfDimensions * sizeof( PixelValueType ), "Pixels must not be padded" );
+  // The image to be normalized is overwritten only when the caller
+  // asks for that.
+  this->InPlaceOff();
 }
 
 
-template< typename TImage >
+template< typename TImage, typename TCalcElement >
 void
-StructurePreservingColorNormalizationFilter< TImage >
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
 ::PrintSelf( std::ostream & os, Indent indent ) const
 {
   Superclass::PrintSelf( os, indent );
 
   os << indent << "ColorIndexSuppressedByHematoxylin: " << m_ColorIndexSuppressedByHematoxylin << std::endl
-     << indent << "ColorIndexSuppressedByEosin: " << m_ColorIndexSuppressedByEosin << std::endl;
+     << indent << "ColorIndexSuppressedByEosin: " << m_ColorIndexSuppressedByEosin << std::endl
+     << indent << "NumberOfStreamDivisions: " << m_NumberOfStreamDivisions << std::endl
+     << indent << "MaximumNumberOfPixelsPerStreamDivision: " << m_MaximumNumberOfPixelsPerStreamDivision << std::endl
+     << indent << "RandomAccessSampling: " << m_RandomAccessSampling << std::endl
+     << indent << "MaximumNumberOfSamples: " << m_MaximumNumberOfSamples << std::endl
+     << indent << "MaximumNumberOfIterations: " << m_MaximumNumberOfIterations << std::endl
+     << indent << "ConvergenceThreshold: " << m_ConvergenceThreshold << std::endl
+     << indent << "SecondPassDistinguishersThreshold: " << m_SecondPassDistinguishersThreshold << std::endl
+     << indent << "BrightPercentileLevel: " << m_BrightPercentileLevel << std::endl
+     << indent << "BrightPercentageLevel: " << m_BrightPercentageLevel << std::endl
+     << indent << "VeryDarkPercentileLevel: " << m_VeryDarkPercentileLevel << std::endl
+     << indent << "UseMultiplicativeUpdates: " << m_UseMultiplicativeUpdates << std::endl
+     << indent << "UseSharedReferenceCache: " << m_UseSharedReferenceCache << std::endl
+     << indent << "UseColorLookupTable: " << m_UseColorLookupTable << std::endl
+     << indent << "ColorLookupTableSize: " << m_ColorLookupTableSize << std::endl
+     << indent << "SkipBackground: " << m_SkipBackground << std::endl
+     << indent << "BackgroundThreshold: " << m_BackgroundThreshold << std::endl
+     << indent << "InputEstimationTime: " << m_InputEstimationTime << std::endl
+     << indent << "ReferenceEstimationTime: " << m_ReferenceEstimationTime << std::endl
+     << indent << "InputNumberOfIterations: " << m_InputNumberOfIterations << std::endl
+     << indent << "ReferenceNumberOfIterations: " << m_ReferenceNumberOfIterations << std::endl
+     << indent << "NumberOfBackgroundPixels: " << m_NumberOfBackgroundPixels << std::endl
+     << indent << "MeasurePhases: " << m_MeasurePhases << std::endl
+     << indent << "UseInputStainModel: " << m_UseInputStainModel << std::endl
+     << indent << "UseReferenceStainModel: " << m_UseReferenceStainModel << std::endl;
 }
 
 
-template< typename TImage >
+template< typename TImage, typename TCalcElement >
+typename StructurePreservingColorNormalizationFilter< TImage, TCalcElement >::StainModelType
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::GetInputStainModel() const
+{
+  if( m_UseInputStainModel )
+    {
+    return m_InputStainModel;
+    }
+  return StainModelType {m_InputH.template cast< StainModelType::CalcElementType >(), m_InputUnstainedPixel.template cast< StainModelType::CalcElementType >()};
+}
+
+
+template< typename TImage, typename TCalcElement >
+typename StructurePreservingColorNormalizationFilter< TImage, TCalcElement >::StainModelType
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::GetReferenceStainModel() const
+{
+  if( m_UseReferenceStainModel )
+    {
+    return m_ReferenceStainModel;
+    }
+  return StainModelType {m_ReferenceH.template cast< StainModelType::CalcElementType >(), m_ReferenceUnstainedPixel.template cast< StainModelType::CalcElementType >()};
+}
+
+
+template< typename TImage, typename TCalcElement >
+void
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::SetInputStainModel( const StainModelType &model )
+{
+  itkAssertOrThrowMacro( model.GetNumberOfStains() == NumberOfStains, "An input stain model needs exactly two stains" );
+  m_InputStainModel = model;
+  m_UseInputStainModel = true;
+  this->Modified();
+}
+
+
+template< typename TImage, typename TCalcElement >
+void
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::ClearInputStainModel()
+{
+  if( m_UseInputStainModel )
+    {
+    m_InputStainModel = StainModelType {};
+    m_UseInputStainModel = false;
+    this->Modified();
+    }
+}
+
+
+template< typename TImage, typename TCalcElement >
+typename StructurePreservingColorNormalizationFilter< TImage, TCalcElement >::StainModelType
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::EstimateStainModel( ImageType *image )
+{
+  this->ValidateParameters();
+  itkAssertOrThrowMacro( image != nullptr, "An image needs to be supplied to estimate its stain model" );
+  image->UpdateOutputInformation();
+  if /*constexpr*/( Self::PixelHelper< PixelType >::NumberOfDimensions < 0 )
+    {
+    m_NumberOfDimensions = image->GetNumberOfComponentsPerPixel();
+    m_NumberOfColors = m_NumberOfDimensions;
+    itkAssertOrThrowMacro( m_NumberOfColors >= 3, "Images need at least 3 colors but the image whose stain model is to be estimated does not" );
+    }
+
+  CalcMatrixType matrixH;
+  CalcRowVectorType unstainedPixel {1, m_NumberOfColors};
+  itkAssertOrThrowMacro( this->ImageToNMF( image, matrixH, unstainedPixel ) == 0,
+    "The stain model could not be estimated; does the image have white, blue, and pink pixels?" );
+  return StainModelType {matrixH.template cast< StainModelType::CalcElementType >(), unstainedPixel.template cast< StainModelType::CalcElementType >()};
+}
+
+
+template< typename TImage, typename TCalcElement >
+void
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::SetReferenceStainModel( const StainModelType &model )
+{
+  itkAssertOrThrowMacro( model.GetNumberOfStains() == NumberOfStains, "A reference stain model needs exactly two stains" );
+  m_ReferenceStainModel = model;
+  m_UseReferenceStainModel = true;
+  this->Modified();
+}
+
+
+template< typename TImage, typename TCalcElement >
+void
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::ClearReferenceStainModel()
+{
+  if( m_UseReferenceStainModel )
+    {
+    m_ReferenceStainModel = StainModelType {};
+    m_UseReferenceStainModel = false;
+    this->Modified();
+    }
+}
+
+
+template< typename TImage, typename TCalcElement >
+std::string
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::GetInputStainModelJSON() const
+{
+  std::ostringstream os;
+  this->GetInputStainModel().WriteJSON( os );
+  return os.str();
+}
+
+
+template< typename TImage, typename TCalcElement >
+std::string
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::GetReferenceStainModelJSON() const
+{
+  std::ostringstream os;
+  this->GetReferenceStainModel().WriteJSON( os );
+  return os.str();
+}
+
+
+template< typename TImage, typename TCalcElement >
+void
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::SetInputStainModelJSON( const std::string &json )
+{
+  std::istringstream is {json};
+  StainModelType model;
+  model.ReadJSON( is );
+  this->SetInputStainModel( model );
+}
+
+
+template< typename TImage, typename TCalcElement >
+void
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::SetReferenceStainModelJSON( const std::string &json )
+{
+  std::istringstream is {json};
+  StainModelType model;
+  model.ReadJSON( is );
+  this->SetReferenceStainModel( model );
+}
+
+
+template< typename TImage, typename TCalcElement >
+typename StructurePreservingColorNormalizationFilter< TImage, TCalcElement >::PixelTransformCoefficients
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::GetPixelTransformCoefficients() const
+{
+  const StainModelType inputModel {this->GetInputStainModel()};
+  const StainModelType referenceModel {this->GetReferenceStainModel()};
+  if( inputModel.IsEmpty() || referenceModel.IsEmpty() )
+    {
+    return PixelTransformCoefficients {};
+    }
+  itkAssertOrThrowMacro( inputModel.GetNumberOfColors() == referenceModel.GetNumberOfColors(),
+    "The input and reference stain models need the same number of colors" );
+
+  // Compute the model as BeforeThreadedGenerateData does.
+  const CalcMatrixType inputH {inputModel.GetMatrixH().template cast< CalcElementType >()};
+  CalcMatrixType referenceH {referenceModel.GetMatrixH().template cast< CalcElementType >()};
+  Self::SynchronizeStains( inputH, referenceH );
+  TransformModel model;
+  this->NMFsToTransformModel( inputH, inputModel.GetUnstainedPixel().template cast< CalcElementType >(),
+    referenceH, referenceModel.GetUnstainedPixel().template cast< CalcElementType >(), model );
+
+  return Self::TransformModelToCoefficients( model );
+}
+
+
+template< typename TImage, typename TCalcElement >
+std::vector< typename StructurePreservingColorNormalizationFilter< TImage, TCalcElement >::ImagePointer >
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::NormalizeBatch( const std::vector< ImagePointer > &inputImages )
+{
+  std::vector< ImagePointer > outputImages( inputImages.size() );
+  this->BatchToImages( inputImages, outputImages );
+  return outputImages;
+}
+
+
+template< typename TImage, typename TCalcElement >
+void
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::NormalizeBatch( const std::vector< ImagePointer > &inputImages, const std::vector< ImagePointer > &outputImages )
+{
+  itkAssertOrThrowMacro( outputImages.size() == inputImages.size(), "A batch needs one output image for each input image" );
+  for( SizeValueType image {0}; image < inputImages.size(); ++image )
+    {
+    itkAssertOrThrowMacro( inputImages[image].IsNotNull() && outputImages[image].IsNotNull(), "Each image of a batch and its output image need to be supplied" );
+    itkAssertOrThrowMacro( outputImages[image]->GetLargestPossibleRegion() == inputImages[image]->GetLargestPossibleRegion()
+      && outputImages[image]->GetBufferedRegion() == outputImages[image]->GetLargestPossibleRegion(),
+      "Each output image of a batch needs to be entirely in memory, with the largest possible region of its input image" );
+    itkAssertOrThrowMacro( outputImages[image]->GetNumberOfComponentsPerPixel() == inputImages[image]->GetNumberOfComponentsPerPixel(),
+      "Each output image of a batch needs the number of colors of its input image" );
+    }
+  std::vector< ImagePointer > batchOutputImages {outputImages};
+  this->BatchToImages( inputImages, batchOutputImages );
+}
+
+
+template< typename TImage, typename TCalcElement >
+void
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::NormalizeTiles( const ImageType *inputTiles, ImageType *outputTiles, SizeValueType numberOfTiles )
+{
+  itkAssertOrThrowMacro( inputTiles != nullptr && outputTiles != nullptr, "The input tiles and the output tiles need to be supplied" );
+  const RegionType region {inputTiles->GetLargestPossibleRegion()};
+  itkAssertOrThrowMacro( inputTiles->GetBufferedRegion() == region && outputTiles->GetLargestPossibleRegion() == region
+    && outputTiles->GetBufferedRegion() == region, "The input tiles and the output tiles need to be entirely in memory, with the same largest possible region" );
+  constexpr unsigned int slowestDimension {ImageType::ImageDimension - 1};
+  itkAssertOrThrowMacro( numberOfTiles > 0 && region.GetSize( slowestDimension ) % numberOfTiles == 0,
+    "The size of the slowest varying dimension of the tiles needs to be a multiple of the number of tiles" );
+
+  const SizeValueType tileSize {region.GetSize( slowestDimension ) / numberOfTiles};
+  std::vector< ImagePointer > inputImages;
+  std::vector< ImagePointer > outputImages;
+  inputImages.reserve( numberOfTiles );
+  outputImages.reserve( numberOfTiles );
+  for( SizeValueType tile {0}; tile < numberOfTiles; ++tile )
+    {
+    RegionType tileRegion {region};
+    tileRegion.SetIndex( slowestDimension, region.GetIndex( slowestDimension ) + static_cast< IndexValueType >( tile * tileSize ) );
+    tileRegion.SetSize( slowestDimension, tileSize );
+    inputImages.push_back( Self::TileView( inputTiles, tileRegion ) );
+    outputImages.push_back( outputTiles == inputTiles ? inputImages.back() : Self::TileView( outputTiles, tileRegion ) );
+    }
+  this->NormalizeBatch( inputImages, outputImages );
+}
+
+
+// static method
+template< typename TImage, typename TCalcElement >
+typename StructurePreservingColorNormalizationFilter< TImage, TCalcElement >::ImagePointer
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::TileView( const ImageType *image, const RegionType &region )
+{
+  // The view's pixels are read and written where they are, and the
+  // view does not free them.
+  using InternalPixelType = typename ImageType::InternalPixelType;
+  const SizeValueType numberOfValues {region.GetNumberOfPixels() * image->GetNumberOfComponentsPerPixel()};
+  const ImagePointer view {ImageType::New()};
+  view->CopyInformation( image );
+  view->SetRegions( region );
+  view->SetNumberOfComponentsPerPixel( image->GetNumberOfComponentsPerPixel() );
+  view->GetPixelContainer()->SetImportPointer(
+    reinterpret_cast< InternalPixelType * >( const_cast< PixelValueType * >( Self::BufferPointer( image, region.GetIndex() ) ) ),
+    numberOfValues * sizeof( PixelValueType ) / sizeof( InternalPixelType ), false );
+  return view;
+}
+
+
+template< typename TImage, typename TCalcElement >
+void
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::BatchToImages( const std::vector< ImagePointer > &inputImages, std::vector< ImagePointer > &outputImages )
+{
+  this->ValidateParameters();
+  if( inputImages.empty() )
+    {
+    return;
+    }
+  for( const ImagePointer &inputImage : inputImages )
+    {
+    itkAssertOrThrowMacro( inputImage.IsNotNull(), "Each image of a batch needs to be supplied" );
+    }
+
+  // A runtime check for number of colors is needed for a
+  // VectorImage.  Every image of the batch is checked against the
+  // first.
+  if /*constexpr*/( Self::PixelHelper< PixelType >::NumberOfDimensions < 0 )
+    {
+    m_NumberOfDimensions = inputImages.front()->GetNumberOfComponentsPerPixel();
+    m_NumberOfColors = m_NumberOfDimensions;
+    itkAssertOrThrowMacro( m_NumberOfColors >= 3, "Images need at least 3 colors but an image of the batch does not" );
+    }
+
+  // Find the reference stain model once for the whole batch, from the
+  // supplied model, the cache, or the reference image.
+  ImageType * const referenceImage = const_cast< ImageType * >( this->GetInput( 1 ) ); // reference image
+  if( m_UseReferenceStainModel )
+    {
+    m_Reference = nullptr;
+    m_ReferenceH = m_ReferenceStainModel.GetMatrixH().template cast< CalcElementType >();
+    m_ReferenceUnstainedPixel = m_ReferenceStainModel.GetUnstainedPixel().template cast< CalcElementType >();
+    }
+  else if( referenceImage != nullptr )
+    {
+    referenceImage->UpdateOutputInformation();
+    if( referenceImage != m_Reference || Self::ContentMTime( referenceImage ) != m_ReferenceMTime )
+      {
+      itkAssertOrThrowMacro( m_NumberOfDimensions == referenceImage->GetNumberOfComponentsPerPixel(),
+        "The reference image needs its number of colors to be exactly the same as the images to be normalized" );
+      CalcMatrixType referenceH;
+      CalcRowVectorType referenceUnstainedPixel {1, m_NumberOfColors};
+      SampleMatrix referenceSamples;
+      this->ImageToMatrix( referenceImage, referenceSamples );
+      SizeValueType referenceNumberOfIterations;
+      if( this->ReferenceMatricesToNMF( referenceSamples, referenceH, referenceUnstainedPixel, referenceNumberOfIterations ) != 0 )
+        {
+        // we failed
+        m_Reference = nullptr;
+        itkAssertOrThrowMacro( m_Reference != nullptr, "The reference image could not be processed; does it have white, blue, and pink pixels?" )
+        }
+      m_ReferenceH = referenceH;
+      m_ReferenceUnstainedPixel = referenceUnstainedPixel;
+      m_Reference = referenceImage;
+      m_ReferenceMTime = Self::ContentMTime( referenceImage );
+      }
+    }
+  itkAssertOrThrowMacro( m_UseReferenceStainModel || m_Reference != nullptr,
+    "A reference image needs to be supplied as input image #1, or a reference stain model needs to be set" );
+  itkAssertOrThrowMacro( m_ReferenceUnstainedPixel.size() == m_NumberOfColors,
+    "The reference needs its number of colors to be exactly the same as the images to be normalized" );
+  itkAssertOrThrowMacro( !m_UseInputStainModel || m_InputStainModel.GetNumberOfColors() == m_NumberOfColors,
+    "The input stain model needs its number of colors to be exactly the same as the images to be normalized" );
+  this->BuildLookupTables();
+  if( CanUseColorLookupTable && m_UseColorLookupTable && m_UseInputStainModel )
+    {
+    // Every image of the batch has the same transform, so it is
+    // tabulated once.
+    const CalcMatrixType inputH {m_InputStainModel.GetMatrixH().template cast< CalcElementType >()};
+    CalcMatrixType referenceH {m_ReferenceH};
+    Self::SynchronizeStains( inputH, referenceH );
+    TransformModel model;
+    this->NMFsToTransformModel( inputH, m_InputStainModel.GetUnstainedPixel().template cast< CalcElementType >(), referenceH, m_ReferenceUnstainedPixel, model );
+    this->BuildColorLookupTable( model );
+    }
+
+  // Each work unit repeatedly takes the next image that no work unit
+  // has yet taken and normalizes it by itself, so that work units
+  // that draw small images take more of them and none sits idle while
+  // images remain.  The first exception is passed on once all work
+  // units are done.
+  const SizeValueType numberOfImages {inputImages.size()};
+  m_NumberOfBackgroundPixels = 0;
+  std::atomic< SizeValueType > nextImage {0};
+  std::mutex exceptionMutex;
+  std::exception_ptr firstException;
+  const auto normalizeImages = [this, &inputImages, &outputImages, numberOfImages, &nextImage, &exceptionMutex, &firstException] ( SizeValueType )
+    {
+    for( SizeValueType image {nextImage++}; image < numberOfImages; image = nextImage++ )
+      {
+      try
+        {
+        SizeValueType numberOfBackgroundPixels {0};
+        outputImages[image] = this->BatchImageToImage( inputImages[image], outputImages[image], numberOfBackgroundPixels );
+        m_NumberOfBackgroundPixels += numberOfBackgroundPixels;
+        }
+      catch( ... )
+        {
+        const std::lock_guard< std::mutex > lock {exceptionMutex};
+        if( !firstException )
+          {
+          firstException = std::current_exception();
+          }
+        }
+      }
+    };
+  const SizeValueType numberOfWorkUnits {std::min( static_cast< SizeValueType >( this->GetNumberOfWorkUnits() ), numberOfImages )};
+  // The multithreader is the filter's, so its number of work units is
+  // restored for later updates.
+  MultiThreaderBase * const multiThreader {this->GetMultiThreader()};
+  const ThreadIdType previousNumberOfWorkUnits {multiThreader->GetNumberOfWorkUnits()};
+  multiThreader->SetNumberOfWorkUnits( numberOfWorkUnits );
+  multiThreader->ParallelizeArray( 0, numberOfWorkUnits, normalizeImages, nullptr );
+  multiThreader->SetNumberOfWorkUnits( previousNumberOfWorkUnits );
+  if( firstException )
+    {
+    std::rethrow_exception( firstException );
+    }
+}
+
+
+template< typename TImage, typename TCalcElement >
+typename StructurePreservingColorNormalizationFilter< TImage, TCalcElement >::ImagePointer
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::BatchImageToImage( const ImageType *inputImage, ImageType *outputImage, SizeValueType &numberOfBackgroundPixels ) const
+{
+  // The whole image is in memory, so its pipeline need not be
+  // updated.  Sampling and estimation are single threaded because the
+  // work units are busy with other images.
+  ImageType * const image = const_cast< ImageType * >( inputImage );
+  itkAssertOrThrowMacro( image->GetBufferedRegion() == image->GetLargestPossibleRegion(), "Each image of a batch needs to be entirely in memory" );
+  itkAssertOrThrowMacro( static_cast< Eigen::Index >( image->GetNumberOfComponentsPerPixel() ) == m_NumberOfDimensions,
+    "Each image of a batch needs the same number of colors" );
+  CalcMatrixType inputH;
+  CalcRowVectorType inputUnstainedPixel {1, m_NumberOfColors};
+  if( m_UseInputStainModel )
+    {
+    inputH = m_InputStainModel.GetMatrixH().template cast< CalcElementType >();
+    inputUnstainedPixel = m_InputStainModel.GetUnstainedPixel().template cast< CalcElementType >();
+    }
+  else
+    {
+    SampleMatrix samples;
+    this->ImageToMatrix( image, samples, false );
+    SizeValueType numberOfIterations;
+    itkAssertOrThrowMacro( this->MatricesToNMF( samples, inputH, inputUnstainedPixel, numberOfIterations, nullptr, nullptr, false ) == 0,
+      "An image of the batch could not be processed; does it have white, blue, and pink pixels?" );
+    }
+  CalcMatrixType referenceH {m_ReferenceH};
+  Self::SynchronizeStains( inputH, referenceH );
+  TransformModel model;
+  this->NMFsToTransformModel( inputH, inputUnstainedPixel, referenceH, m_ReferenceUnstainedPixel, model );
+
+  // In place, the image is its own output; each pixel is read before
+  // it is written.
+  ImagePointer outputImagePointer {outputImage};
+  if( outputImagePointer.IsNull() && this->GetInPlace() )
+    {
+    outputImagePointer = image;
+    }
+  else if( outputImagePointer.IsNull() )
+    {
+    outputImagePointer = ImageType::New();
+    outputImagePointer->CopyInformation( image );
+    outputImagePointer->SetRegions( image->GetLargestPossibleRegion() );
+    outputImagePointer->SetNumberOfComponentsPerPixel( image->GetNumberOfComponentsPerPixel() );
+    outputImagePointer->Allocate();
+    }
+  RegionIterator outIt {outputImagePointer, outputImagePointer->GetLargestPossibleRegion()};
+  if( CanUseColorLookupTable && m_UseColorLookupTable && m_UseInputStainModel )
+    {
+    // NormalizeBatch has tabulated this transform.
+    this->ColorLookupTableToImage( image, outIt );
+    return outputImagePointer;
+    }
+  numberOfBackgroundPixels = this->NMFsToImage( image, model, outIt );
+  return outputImagePointer;
+}
+
+
+template< typename TImage, typename TCalcElement >
 void
-StructurePreservingColorNormalizationFilter< TImage >
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
 ::VerifyInputInformation() const
 {
   // It does not matter whether the input and reference images
@@ -63,39 +564,42 @@ StructurePreservingColorNormalizationFilter< TImage >
 }
 
 
-template< typename TImage >
+template< typename TImage, typename TCalcElement >
 void
-StructurePreservingColorNormalizationFilter< TImage >
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
 ::GenerateInputRequestedRegion()
 {
-  // Call the superclass' implementation of this method
+  // Call the superclass' implementation of this method.  For the
+  // image to be normalized, it requests the region that corresponds
+  // to the output requested region, which is all that the output
+  // pass needs.  Any stain estimation is done by GenerateData, which
+  // makes its own requests of each image.
   Superclass::GenerateInputRequestedRegion();
 
-  // Get pointers to the input image ( to be normalized ) and
-  // reference image.
-  ImageType *inputImage = const_cast< ImageType * >( this->GetInput( 0 ) );
+  // Get pointers to the input and reference images.
+  const ImageType * const inputImage = this->GetInput( 0 );
   ImageType *referenceImage = const_cast< ImageType * >( this->GetInput( 1 ) );
 
-  if( inputImage != nullptr )
-    {
-    inputImage->SetRequestedRegionToLargestPossibleRegion();
-    }
-
-  if( referenceImage != nullptr )
+  // The output pass does not use the reference image at all, so ask
+  // for as little of it as possible, unless it is the image to be
+  // normalized or comes from the same source, whose request would
+  // then be shrunk too.
+  const bool sharesInput {inputImage != nullptr && referenceImage != nullptr
+    && ( referenceImage == inputImage || ( referenceImage->GetSource() != nullptr && referenceImage->GetSource() == inputImage->GetSource() ) )};
+  if( referenceImage != nullptr && !sharesInput )
     {
-    referenceImage->SetRequestedRegionToLargestPossibleRegion();
+    SizeType referenceSize;
+    referenceSize.Fill( 1 );
+    referenceImage->SetRequestedRegion( RegionType {referenceImage->GetLargestPossibleRegion().GetIndex(), referenceSize} );
     }
 }
 
 
-template< typename TImage >
+template< typename TImage, typename TCalcElement >
 void
-StructurePreservingColorNormalizationFilter< TImage >
-::BeforeThreadedGenerateData()
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::ValidateParameters()
 {
-  // Call the superclass' implementation of this method
-  Superclass::BeforeThreadedGenerateData();
-
   // this->Modified() is called if a itkSetMacro is invoked, but not
   // if a this->GetInput() value is changed, right?!!!  Otherwise, we
   // need to implement our own set methods to update a separate MTime
@@ -106,6 +610,8 @@ StructurePreservingColorNormalizationFilter< TImage >
     // m_ColorIndexSuppressedByEosin has changed since we built the
     // cache, so clear the cache.  The empty cache is current as of
     // the most recent modification.
+    m_Input = nullptr;
+    m_InputMTime = 0;
     m_Reference = nullptr;
     m_ParametersMTime = this->GetMTime();
     }
@@ -117,100 +623,334 @@ StructurePreservingColorNormalizationFilter< TImage >
   // directly.  Check that they have been set.
   itkAssertOrThrowMacro( m_ColorIndexSuppressedByHematoxylin >= 0 && m_ColorIndexSuppressedByEosin >= 0,
     "Need to set ColorIndexSuppressedByHematoxylin and ColorIndexSuppressedByEosin before using StructurePreservingColorNormalizationFilter" );
+}
+
+
+template< typename TImage, typename TCalcElement >
+void
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::GenerateData()
+{
+  this->ValidateParameters();
 
-  // Find inputImage and referenceImage and make iterators for them.
-  const ImageType * const inputImage = this->GetInput( 0 ); // image to be normalized
-  const ImageType * const referenceImage = this->GetInput( 1 ); // reference image
+  // Find inputImage and referenceImage.
+  ImageType * const inputImage = const_cast< ImageType * >( this->GetInput( 0 ) ); // image to be normalized
+  ImageType * const referenceImage = const_cast< ImageType * >( this->GetInput( 1 ) ); // reference image
   // For each of the two images, make sure that it was supplied, or
   // that we have it cached already.
   itkAssertOrThrowMacro( inputImage != nullptr, "An image to be normalized needs to be supplied as input image #0" );
-  itkAssertOrThrowMacro( referenceImage != nullptr || m_Reference != nullptr, "A reference image needs to be supplied as input image #1" );
+  itkAssertOrThrowMacro( referenceImage != nullptr || m_Reference != nullptr || m_UseReferenceStainModel,
+    "A reference image needs to be supplied as input image #1" );
+  const bool inputIsCached {m_UseInputStainModel || ( inputImage == m_Input && m_InputMTime != 0 && Self::ContentMTime( inputImage ) == m_InputMTime )};
+  const bool referenceIsCached {m_UseReferenceStainModel || referenceImage == nullptr
+    || ( referenceImage == m_Reference && Self::ContentMTime( referenceImage ) == m_ReferenceMTime )};
+  if( m_UseInputStainModel )
+    {
+    // A supplied input stain model, such as one estimated from a
+    // whole slide, stands in for an estimate from this image.
+    m_Input = inputImage;
+    m_InputMTime = 0;
+    m_InputH = m_InputStainModel.GetMatrixH().template cast< CalcElementType >();
+    m_InputUnstainedPixel = m_InputStainModel.GetUnstainedPixel().template cast< CalcElementType >();
+    }
+  if( m_UseReferenceStainModel )
+    {
+    // A supplied reference stain model stands in for the reference
+    // image.
+    m_Reference = nullptr;
+    m_ReferenceH = m_ReferenceStainModel.GetMatrixH().template cast< CalcElementType >();
+    m_ReferenceUnstainedPixel = m_ReferenceStainModel.GetUnstainedPixel().template cast< CalcElementType >();
+    }
 
-  // For each image, if there is a supplied image and it is different
-  // from what we have cached then compute stuff and cache the
-  // results.  These two calls to ImageToNMF could be done
-  // simultaneously.
-  RegionConstIterator inIt {inputImage, inputImage->GetRequestedRegion()};
   // A runtime check for number of colors is needed for a
   // VectorImage.
   if /*constexpr*/( Self::PixelHelper< PixelType >::NumberOfDimensions < 0 )
     {
-    inIt.GoToBegin();
-    m_NumberOfDimensions = inIt.Get().Size();
+    m_NumberOfDimensions = inputImage->GetNumberOfComponentsPerPixel();
     m_NumberOfColors = m_NumberOfDimensions;
     itkAssertOrThrowMacro( m_NumberOfColors >= 3, "Images need at least 3 colors but the input image to be normalized does not" );
-    if( referenceImage == nullptr || ( referenceImage == m_Reference && referenceImage->GetTimeStamp() == m_ReferenceTimeStamp ) )
+    if( referenceIsCached )
       {
-      RegionConstIterator refIt {m_Reference, m_Reference->GetRequestedRegion()};
-      refIt.GoToBegin();
-      itkAssertOrThrowMacro( m_NumberOfColors == refIt.Get().Size(),
+      itkAssertOrThrowMacro( m_NumberOfColors == m_ReferenceUnstainedPixel.size(),
         "The ( cached ) reference image needs its number of colors to be exactly the same as the input image to be normalized" );
       }
+    else
+      {
+      itkAssertOrThrowMacro( m_NumberOfColors == referenceImage->GetNumberOfComponentsPerPixel(),
+        "The reference image needs its number of colors to be exactly the same as the input image to be normalized" );
+      }
     }
+  itkAssertOrThrowMacro( !m_UseInputStainModel || m_InputStainModel.GetNumberOfColors() == m_NumberOfColors,
+    "The input stain model needs its number of colors to be exactly the same as the input image to be normalized" );
+  itkAssertOrThrowMacro( !m_UseReferenceStainModel || m_ReferenceStainModel.GetNumberOfColors() == m_NumberOfColors,
+    "The reference stain model needs its number of colors to be exactly the same as the input image to be normalized" );
 
-  m_InputUnstainedPixel = CalcRowVectorType {1, m_NumberOfColors};
+  // For each image, if there is a supplied image and it is different
+  // from what we have cached then compute stuff and cache the
+  // results.  Sampling an image updates its pipeline, so the images
+  // are sampled one after the other.  The estimates from the samples
+  // are independent, so when both images need one they are computed
+  // concurrently.  Sampling and estimating each image take a share of
+  // the update's progress, and the output pass takes the rest.
+  constexpr float samplingShare {0.1f};
+  constexpr float estimationShare {0.2f};
+  float progressStart {0.0f};
+  m_PhaseStatistics = PhaseStatistics {};
+  m_PhaseStatistics.input.cached = inputIsCached;
+  m_PhaseStatistics.reference.cached = referenceIsCached;
+  EstimationStatistics * const inputStatistics {m_MeasurePhases ? &m_PhaseStatistics.input : nullptr};
+  EstimationStatistics * const referenceStatistics {m_MeasurePhases ? &m_PhaseStatistics.reference : nullptr};
+  TimeProbe inputProbe;
+  TimeProbe referenceProbe;
+  SampleMatrix inputSamples;
+  if( !inputIsCached )
+    {
+    const EstimationProgress samplingProgress {this, progressStart, samplingShare};
+    progressStart += samplingShare;
+    inputProbe.Start();
+    this->ImageToMatrix( inputImage, inputSamples, true, &samplingProgress );
+    inputProbe.Stop();
+    m_PhaseStatistics.input.samplingTime = inputProbe.GetTotal();
+    }
+  SampleMatrix referenceSamples;
+  if( !referenceIsCached )
+    {
+    const EstimationProgress samplingProgress {this, progressStart, samplingShare};
+    progressStart += samplingShare;
+    referenceProbe.Start();
+    this->ImageToMatrix( referenceImage, referenceSamples, true, &samplingProgress );
+    referenceProbe.Stop();
+    m_PhaseStatistics.reference.samplingTime = referenceProbe.GetTotal();
+    }
 
-  if( this->ImageToNMF( inIt, m_InputH, m_InputUnstainedPixel ) != 0 )
+  // When both estimates are computed, the one on this thread reports
+  // the progress of both.
+  const float estimationWeight {estimationShare * ( ( inputIsCached ? 0 : 1 ) + ( referenceIsCached ? 0 : 1 ) )};
+  const EstimationProgress inputProgress {referenceIsCached ? this : nullptr, progressStart, estimationWeight};
+  const EstimationProgress referenceProgress {this, progressStart, estimationWeight};
+  progressStart += estimationWeight;
+  CalcMatrixType inputH;
+  CalcRowVectorType inputUnstainedPixel {1, m_NumberOfColors};
+  SizeValueType inputNumberOfIterations {0};
+  const auto estimateInput = [this, &inputProbe, &inputSamples, &inputH, &inputUnstainedPixel, &inputNumberOfIterations, inputStatistics,
+    &inputProgress] () -> int
+    {
+    inputProbe.Start();
+    const int inputFailed {this->MatricesToNMF( inputSamples, inputH, inputUnstainedPixel, inputNumberOfIterations, inputStatistics, &inputProgress )};
+    inputProbe.Stop();
+    return inputFailed;
+    };
+  CalcMatrixType referenceH;
+  CalcRowVectorType referenceUnstainedPixel {1, m_NumberOfColors};
+  SizeValueType referenceNumberOfIterations {0};
+  const auto estimateReference = [this, &referenceProbe, &referenceSamples, &referenceH, &referenceUnstainedPixel, &referenceNumberOfIterations,
+    referenceStatistics, &referenceProgress] () -> int
     {
-    // we failed
-    itkAssertOrThrowMacro( m_Input != nullptr, "The image to be normalized could not be processed; does it have white, blue, and pink pixels?" )
+    referenceProbe.Start();
+    const int referenceFailed {this->ReferenceMatricesToNMF( referenceSamples, referenceH, referenceUnstainedPixel, referenceNumberOfIterations,
+      referenceStatistics, &referenceProgress )};
+    referenceProbe.Stop();
+    return referenceFailed;
+    };
+  int inputFailed {0};
+  int referenceFailed {0};
+  if( !inputIsCached && !referenceIsCached )
+    {
+    std::future< int > inputFuture {std::async( std::launch::async, estimateInput )};
+    referenceFailed = estimateReference();
+    inputFailed = inputFuture.get();
+    }
+  else if( !inputIsCached )
+    {
+    inputFailed = estimateInput();
+    }
+  else if( !referenceIsCached )
+    {
+    referenceFailed = estimateReference();
     }
-  m_Input = inputImage;
+  m_InputEstimationTime = inputProbe.GetTotal();
+  m_ReferenceEstimationTime = referenceProbe.GetTotal();
+  m_InputNumberOfIterations = inputNumberOfIterations;
+  m_ReferenceNumberOfIterations = referenceNumberOfIterations;
 
-  if( referenceImage != nullptr && ( referenceImage != m_Reference || referenceImage->GetTimeStamp() != m_ReferenceTimeStamp ) )
+  if( !inputIsCached )
     {
-    // For VectorImage, check that number of colors is right in the
-    // newly supplied reference image
-    RegionConstIterator refIt {referenceImage, referenceImage->GetRequestedRegion()};
-    if /*constexpr*/( Self::PixelHelper< PixelType >::NumberOfDimensions < 0 )
+    if( inputFailed != 0 )
       {
-      refIt.GoToBegin();
-      itkAssertOrThrowMacro( m_NumberOfColors == refIt.Get().Size(),
-        "The reference image needs its number of colors to be exactly the same as the input image to be normalized" );
+      // we failed.  Fall back to the previous estimate, if any, but do
+      // not cache it as the estimate for this image.
+      itkAssertOrThrowMacro( m_Input != nullptr, "The image to be normalized could not be processed; does it have white, blue, and pink pixels?" )
+      m_InputMTime = 0;
       }
-    m_ReferenceUnstainedPixel = CalcRowVectorType {1, m_NumberOfColors};
-    if( this->ImageToNMF( refIt, m_ReferenceH, m_ReferenceUnstainedPixel ) != 0 )
+    else
+      {
+      m_InputH = inputH;
+      m_InputUnstainedPixel = inputUnstainedPixel;
+      m_InputMTime = Self::ContentMTime( inputImage );
+      }
+    m_Input = inputImage;
+    }
+
+  if( !referenceIsCached )
+    {
+    if( referenceFailed != 0 )
       {
       // we failed
       m_Reference = nullptr;
       itkAssertOrThrowMacro( m_Reference != nullptr, "The reference image could not be processed; does it have white, blue, and pink pixels?" )
       }
+    m_ReferenceH = referenceH;
+    m_ReferenceUnstainedPixel = referenceUnstainedPixel;
+    m_Reference = referenceImage;
+    m_ReferenceMTime = Self::ContentMTime( referenceImage );
+    }
+
+  Self::SynchronizeStains( m_InputH, m_ReferenceH );
+
+  // With the stain estimates in hand, allocate the output, or graft
+  // input image #0 onto it when running in place, and run the output
+  // pass as the superclass would, but within the rest of the update's
+  // progress.
+  this->AllocateOutputs();
+  this->BeforeThreadedGenerateData();
+  ProgressTransformer outputProgress {progressStart, 1.0f, this};
+  this->GetMultiThreader()->SetNumberOfWorkUnits( this->GetNumberOfWorkUnits() );
+  this->GetMultiThreader()->template ParallelizeImageRegion< ImageType::ImageDimension >( this->GetOutput()->GetRequestedRegion(),
+    [this] ( const RegionType &outputRegion )
+    {
+    this->DynamicThreadedGenerateData( outputRegion );
+    }, outputProgress.GetProcessObject() );
+  this->AfterThreadedGenerateData();
+}
+
+
+template< typename TImage, typename TCalcElement >
+void
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::BeforeThreadedGenerateData()
+{
+  // Call the superclass' implementation of this method
+  Superclass::BeforeThreadedGenerateData();
+
+  // Compute, once for all threads, what the per-pixel transform
+  // needs.
+  this->NMFsToTransformModel( m_InputH, m_InputUnstainedPixel, m_ReferenceH, m_ReferenceUnstainedPixel, m_TransformModel );
+  m_NumberOfBackgroundPixels = 0;
+
+  this->BuildLookupTables();
+  if( CanUseColorLookupTable && m_UseColorLookupTable )
+    {
+    // The table is replaced only when it is rebuilt.
+    const ImagePointer previousColorLookupTable {m_ColorLookupTable};
+    TimeProbe colorLookupTableProbe;
+    colorLookupTableProbe.Start();
+    this->BuildColorLookupTable( m_TransformModel );
+    colorLookupTableProbe.Stop();
+    m_PhaseStatistics.colorLookupTableCached = m_ColorLookupTable == previousColorLookupTable;
+    m_PhaseStatistics.colorLookupTableTime = colorLookupTableProbe.GetTotal();
+    }
+
+  m_PixelPassProbe.Reset();
+  m_PixelPassProbe.Start();
+}
+
+
+template< typename TImage, typename TCalcElement >
+void
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::AfterThreadedGenerateData()
+{
+  m_PixelPassProbe.Stop();
+  m_PhaseStatistics.pixelPassTime = m_PixelPassProbe.GetTotal();
+  m_PhaseStatistics.numberOfBackgroundPixels = m_NumberOfBackgroundPixels;
+
+  // Call the superclass' implementation of this method
+  Superclass::AfterThreadedGenerateData();
+
+  if( m_MeasurePhases )
+    {
+    this->InvokeEvent( StructurePreservingColorNormalizationStatisticsEvent() );
+    }
+}
+
+
+template< typename TImage, typename TCalcElement >
+void
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::BuildLookupTables()
+{
+  // The lookup tables depend only upon PixelValueType, so they are
+  // built the first time they are needed and are thereafter kept.  In
+  // the code that is compiled, but never run, for other pixel value
+  // types, LookupValueType keeps the table sizes sensible.
+  using LookupValueType = typename std::conditional< UseLogLookupTable, PixelValueType, unsigned char >::type;
+  constexpr SizeValueType numberOfValues {static_cast< SizeValueType >( std::numeric_limits< LookupValueType >::max() ) + 1};
+  if( UseLogLookupTable && m_LogLookupTable.empty() )
+    {
+    m_LogLookupTable.resize( numberOfValues );
+    for( SizeValueType value {0}; value < numberOfValues; ++value )
+      {
+      m_LogLookupTable[value] = std::log( static_cast< CalcElementType >( value ) );
+      }
     }
-  m_Reference = referenceImage;
-  m_ReferenceTimeStamp = referenceImage->GetTimeStamp();
+  if( UseExpLookupTable && m_ExpLookupTable.empty() )
+    {
+    // An output color intensity is std::exp( y ) - 1, truncated and
+    // clamped to the range of PixelValueType.  It is at least value
+    // + 1 exactly when y >= std::log( value + 2 ), so the output is
+    // the number of table entries that are no larger than y.
+    m_ExpLookupTable.resize( numberOfValues - 1 );
+    for( SizeValueType value {0}; value + 1 < numberOfValues; ++value )
+      {
+      m_ExpLookupTable[value] = std::log( static_cast< CalcElementType >( value + 2 ) );
+      }
+    }
+}
+
 
-  if( ( m_InputH * m_ReferenceH.transpose() ).determinant() < CalcElementType( 0 ) )
+// static method
+template< typename TImage, typename TCalcElement >
+void
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::SynchronizeStains( const CalcMatrixType &inputH, CalcMatrixType &referenceH )
+{
+  if( ( inputH * referenceH.transpose() ).determinant() < CalcElementType( 0 ) )
     {
     // Somehow the hematoxylin and eosin rows got swapped in one of
     // the input image or reference image.  Flip them in referenceH to get
     // them in synch.
     static_assert( NumberOfStains == 2, "There must be exactly two stains" );
-    const CalcMatrixType referenceHOriginal {m_ReferenceH};
-    m_ReferenceH.row( 0 ) = referenceHOriginal.row( 1 );
-    m_ReferenceH.row( 1 ) = referenceHOriginal.row( 0 );
+    const CalcMatrixType referenceHOriginal {referenceH};
+    referenceH.row( 0 ) = referenceHOriginal.row( 1 );
+    referenceH.row( 1 ) = referenceHOriginal.row( 0 );
     }
 
-  itkAssertOrThrowMacro( ( m_InputH * m_ReferenceH.transpose() ).determinant() > CalcElementType( 0 ), "Hematoxylin and Eosin are getting mixed up; failed" );
+  itkAssertOrThrowMacro( ( inputH * referenceH.transpose() ).determinant() > CalcElementType( 0 ), "Hematoxylin and Eosin are getting mixed up; failed" );
 }
 
 
-template< typename TImage >
+template< typename TImage, typename TCalcElement >
 void
-StructurePreservingColorNormalizationFilter< TImage >
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
 ::DynamicThreadedGenerateData( const RegionType & outputRegion )
 {
   ImageType * const outputImage = this->GetOutput();
   itkAssertOrThrowMacro( outputImage != nullptr, "An output image needs to be supplied" )
   RegionIterator outIt {outputImage, outputRegion};
 
-  this->NMFsToImage( m_InputH, m_InputUnstainedPixel, m_ReferenceH, m_ReferenceUnstainedPixel, outIt );
+  if( CanUseColorLookupTable && m_UseColorLookupTable )
+    {
+    this->ColorLookupTableToImage( m_Input, outIt );
+    return;
+    }
+  m_NumberOfBackgroundPixels += this->NMFsToImage( m_Input, m_TransformModel, outIt );
 }
 
 
-template< typename TImage >
+template< typename TImage, typename TCalcElement >
 int
-StructurePreservingColorNormalizationFilter< TImage >
-::ImageToNMF( RegionConstIterator &iter, CalcMatrixType &matrixH, CalcRowVectorType &unstainedPixel ) const
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::ImageToNMF( ImageType *image, CalcMatrixType &matrixH, CalcRowVectorType &unstainedPixel ) const
 {
   // To maintain locality of memory references, we are using
   // numberOfPixels as the number of rows rather than as the number of
@@ -221,16 +961,45 @@ StructurePreservingColorNormalizationFilter< TImage >
   // compact matrix, whereas in Vahadane W is a fairly compact matrix
   // and H is a very wide matrix.
 
-  const SizeType size = iter.GetRegion().GetSize();
-  const SizeValueType numberOfPixels = std::accumulate( size.begin(), size.end(), 1, std::multiplies< SizeValueType >() );
+  SampleMatrix samples;
+  this->ImageToMatrix( image, samples );
+
+  SizeValueType numberOfIterations;
+  return this->MatricesToNMF( samples, matrixH, unstainedPixel, numberOfIterations );
+}
+
+
+template< typename TImage, typename TCalcElement >
+int
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::MatricesToNMF( const SampleMatrix &samples, CalcMatrixType &matrixH, CalcRowVectorType &unstainedPixel, SizeValueType &numberOfIterations,
+  EstimationStatistics *statistics, const EstimationProgress *progress, bool multithreaded ) const
+{
+  // The bright and dark pixels are used where they are in the matrix
+  // of samples.
+  const CalcMatrixConstRefType matrixBrightV {samples.matrixV.bottomRows( samples.matrixV.rows() - samples.firstBrightRow )};
+  const CalcMatrixConstRefType matrixDarkV {samples.matrixV.topRows( samples.endOfDarkRows )};
+  const MultiThreaderBase::Pointer multiThreader {multithreaded ? this->NewEstimationMultiThreader() : nullptr};
+  TimeProbe phaseProbe;
+  if( statistics != nullptr )
+    {
+    statistics->numberOfSamples = samples.matrixV.rows();
+    statistics->numberOfBrightSamples = matrixBrightV.rows();
+    statistics->numberOfDarkSamples = matrixDarkV.rows();
+    statistics->sampleBytes = samples.matrixV.size() * sizeof( CalcElementType );
+    phaseProbe.Start();
+    }
 
   // Find distinguishers.  These are essentially the rows of matrixH.
   CalcMatrixType distinguishers;
-  CalcMatrixType matrixBrightV;
-  CalcMatrixType matrixDarkV;
-
-  this->ImageToMatrix( iter, numberOfPixels, matrixBrightV, matrixDarkV );
   this->MatrixToDistinguishers( matrixBrightV, distinguishers );
+  if( statistics != nullptr )
+    {
+    phaseProbe.Stop();
+    statistics->distinguishersTime = phaseProbe.GetTotal();
+    phaseProbe.Reset();
+    phaseProbe.Start();
+    }
 
   // Use the distinguishers as seeds to the non-negative matrix
   // factorization.
@@ -238,149 +1007,513 @@ StructurePreservingColorNormalizationFilter< TImage >
     {
     return 1;                   // we failed.
     }
+  if( progress != nullptr )
+    {
+    this->CheckAbortGenerateData();
+    }
 
-  // Improve matrixH using Virtanen's algorithm
-  // { std::ostringstream mesg; mesg << "matrixH before VirtanenNMFEuclidean = " << std::endl << matrixH << std::endl; std::cout << mesg.str() << std::flush; }
+  // Improve matrixH using non-negative matrix factorization.
+  // { std::ostringstream mesg; mesg << "matrixH before refinement = " << std::endl << matrixH << std::endl; std::cout << mesg.str() << std::flush; }
     {
     CalcMatrixType matrixW;     // Could end up large.
-    this->VirtanenNMFEuclidean( matrixBrightV, matrixW, matrixH );
+    numberOfIterations = m_UseMultiplicativeUpdates
+      ? this->VirtanenNMFEuclidean( matrixBrightV, matrixW, matrixH, progress, multiThreader )
+      : this->HALSNMFEuclidean( matrixBrightV, matrixW, matrixH, progress, multiThreader );
+    }
+  if( statistics != nullptr )
+    {
+    phaseProbe.Stop();
+    statistics->factorizationTime = phaseProbe.GetTotal();
+    statistics->numberOfIterations = numberOfIterations;
+    phaseProbe.Reset();
+    phaseProbe.Start();
     }
 
   // Rescale each row of matrixH so that the
   // ( 100-VeryDarkPercentileLevel ) value of each column of matrixW is
   // 1.0.
   // { std::ostringstream mesg; mesg << "matrixH before NormalizeMatrixH = " << std::endl << matrixH << std::endl; std::cout << mesg.str() << std::flush; }
-  this->NormalizeMatrixH( matrixDarkV, unstainedPixel, matrixH );
+  this->NormalizeMatrixH( matrixDarkV, unstainedPixel, matrixH, multiThreader );
   // { std::ostringstream mesg; mesg << "matrixH at end = " << std::endl << matrixH << std::endl; std::cout << mesg.str() << std::flush; }
+  if( statistics != nullptr )
+    {
+    phaseProbe.Stop();
+    statistics->normalizationTime = phaseProbe.GetTotal();
+    }
 
   return 0;
 }
 
 
-template< typename TImage >
+template< typename TImage, typename TCalcElement >
+int
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::ReferenceMatricesToNMF( const SampleMatrix &samples, CalcMatrixType &matrixH, CalcRowVectorType &unstainedPixel,
+  SizeValueType &numberOfIterations, EstimationStatistics *statistics, const EstimationProgress *progress ) const
+{
+  if( !m_UseSharedReferenceCache )
+    {
+    return this->MatricesToNMF( samples, matrixH, unstainedPixel, numberOfIterations, statistics, progress );
+    }
+
+  // The estimate depends only upon the samples and the estimation
+  // parameters, so they make the key.
+  using ModelCacheType = StructurePreservingColorNormalizationModelCache;
+  ModelCacheType::KeyBuilder keyBuilder;
+  keyBuilder.Append( sizeof( CalcElementType ) );
+  keyBuilder.Append( m_ColorIndexSuppressedByHematoxylin );
+  keyBuilder.Append( m_ColorIndexSuppressedByEosin );
+  keyBuilder.Append( m_MaximumNumberOfIterations );
+  keyBuilder.Append( m_ConvergenceThreshold );
+  keyBuilder.Append( m_SecondPassDistinguishersThreshold );
+  keyBuilder.Append( m_BrightPercentileLevel );
+  keyBuilder.Append( m_BrightPercentageLevel );
+  keyBuilder.Append( m_VeryDarkPercentileLevel );
+  keyBuilder.Append( m_UseMultiplicativeUpdates );
+  keyBuilder.Append( samples.matrixV.rows() );
+  keyBuilder.Append( samples.matrixV.cols() );
+  keyBuilder.Append( samples.firstBrightRow );
+  keyBuilder.Append( samples.endOfDarkRows );
+  keyBuilder.Append( samples.matrixV.data(), samples.matrixV.size() * sizeof( CalcElementType ) );
+
+  bool found {false};
+  const StainModelType model {ModelCacheType::FindOrEstimate( keyBuilder.GetKey(), [&] () -> StainModelType
+    {
+    if( this->MatricesToNMF( samples, matrixH, unstainedPixel, numberOfIterations, statistics, progress ) != 0 )
+      {
+      return StainModelType {};
+      }
+    return StainModelType {matrixH.template cast< StainModelType::CalcElementType >(), unstainedPixel.template cast< StainModelType::CalcElementType >()};
+    }, found )};
+  if( model.IsEmpty() )
+    {
+    return 1;                   // we failed.
+    }
+  if( found )
+    {
+    matrixH = model.GetMatrixH().template cast< CalcElementType >();
+    unstainedPixel = model.GetUnstainedPixel().template cast< CalcElementType >();
+    numberOfIterations = 0;
+    if( statistics != nullptr )
+      {
+      statistics->cached = true;
+      statistics->numberOfSamples = samples.matrixV.rows();
+      statistics->numberOfBrightSamples = samples.matrixV.rows() - samples.firstBrightRow;
+      statistics->numberOfDarkSamples = samples.endOfDarkRows;
+      statistics->sampleBytes = samples.matrixV.size() * sizeof( CalcElementType );
+      }
+    }
+  return 0;
+}
+
+
+template< typename TImage, typename TCalcElement >
 void
-StructurePreservingColorNormalizationFilter< TImage >
-::ImageToMatrix( RegionConstIterator &iter, SizeValueType numberOfPixels, CalcMatrixType &matrixBrightV, CalcMatrixType &matrixDarkV ) const
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::CheckAbortGenerateData() const
 {
-  // If the image is big, take a random subset of its pixels and put them into matrixV.
+  if( this->GetAbortGenerateData() )
+    {
+    ProcessAborted e( __FILE__, __LINE__ );
+    e.SetDescription( "Process aborted." );
+    e.SetLocation( ITK_LOCATION );
+    throw e;
+    }
+}
+
+
+template< typename TImage, typename TCalcElement >
+void
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::ImageToMatrix( ImageType *image, SampleMatrix &samples, bool multithreaded, const EstimationProgress *progress ) const
+{
+  // If the image is big, take a random subset of its pixels and put
+  // them into matrixV.  The pixels, in the order of a single iterator
+  // over the largest possible region, are divided into strata of
+  // numberOfPixelsPerStratum consecutive pixels.  Each stratum is
+  // allotted a share of the rows that is proportional to its number
+  // of pixels, and selects them with its own seeded random number
+  // generator and its own rows of matrixV.  The selection thus
+  // depends only upon the image, not upon the number of work units
+  // or of stream divisions, and the strata can be sampled in
+  // parallel.  With RandomAccessSampling, a stratum instead divides
+  // its pixels into as many equal cells as it has rows, and reads one
+  // randomly placed pixel from each cell, without visiting the rest.
   using UniformGeneratorType = Statistics::MersenneTwisterRandomVariateGenerator;
-  UniformGeneratorType::Pointer uniformGenerator = UniformGeneratorType::New();
-  uniformGenerator->Initialize( 20200609 );
+  struct StratumState
+    {
+    UniformGeneratorType::Pointer uniformGenerator;
+    SizeValueType startOffset;
+    SizeValueType numberOfPixels;
+    SizeValueType numberOfRows;
+    SizeValueType remainingPixels;
+    SizeValueType remainingRows;
+    SizeValueType nextRow;
+    // For RandomAccessSampling, the offset chosen in the current cell,
+    // or the number of pixels in the image if none has been chosen.
+    SizeValueType pendingOffset;
+    };
 
-  SizeValueType numberOfRows = std::min( numberOfPixels, maxNumberOfRows );
+  const RegionType largestRegion {image->GetLargestPossibleRegion()};
+  const SizeValueType numberOfPixels {largestRegion.GetNumberOfPixels()};
+  const SizeValueType numberOfRows {std::min( numberOfPixels, m_MaximumNumberOfSamples )};
+  // The first row allotted to the stratum that starts at this pixel
+  // offset.
+  const auto firstRowOfOffset = [numberOfPixels, numberOfRows] ( SizeValueType offset ) -> SizeValueType
+    {
+    return offset * numberOfRows / numberOfPixels;
+    };
+  const auto newStratumState = [numberOfPixels, &firstRowOfOffset] ( SizeValueType stratum ) -> StratumState
+    {
+    const SizeValueType startOffset {stratum * numberOfPixelsPerStratum};
+    const SizeValueType endOffset {std::min( startOffset + numberOfPixelsPerStratum, numberOfPixels )};
+    const SizeValueType stratumPixels {endOffset - startOffset};
+    const SizeValueType stratumRows {firstRowOfOffset( endOffset ) - firstRowOfOffset( startOffset )};
+    StratumState state {UniformGeneratorType::New(), startOffset, stratumPixels, stratumRows, stratumPixels, stratumRows,
+      firstRowOfOffset( startOffset ), numberOfPixels};
+    state.uniformGenerator->Initialize( 20200609 + stratum );
+    return state;
+    };
+  const auto offsetToIndex = [&largestRegion] ( SizeValueType offset ) -> IndexType
+    {
+    IndexType pixelIndex;
+    for( unsigned int dim {0}; dim < ImageType::ImageDimension; ++dim )
+      {
+      pixelIndex[dim] = largestRegion.GetIndex( dim ) + static_cast< IndexValueType >( offset % largestRegion.GetSize( dim ) );
+      offset /= largestRegion.GetSize( dim );
+      }
+    return pixelIndex;
+    };
+
+  // The image is requested one piece at a time.  The pieces are slabs
+  // along the slowest varying dimension so, in order, they are
+  // consecutive ranges of pixel offsets.  A stratum that spans two
+  // pieces is carried from one to the next.  There are enough pieces
+  // that none has more than m_MaximumNumberOfPixelsPerStreamDivision
+  // pixels, so that at most one such piece is buffered at a time.
+  // Afterwards, the image's original requested region is restored.
+  const RegionType requestedRegion {image->GetRequestedRegion()};
+  const ImageRegionSplitterSlowDimension::Pointer splitter {ImageRegionSplitterSlowDimension::New()};
+  const SizeValueType numberOfBudgetPieces {numberOfPixels / m_MaximumNumberOfPixelsPerStreamDivision
+    + ( numberOfPixels % m_MaximumNumberOfPixelsPerStreamDivision != 0 ? 1 : 0 )};
+  const unsigned int numberOfPieces {splitter->GetNumberOfSplits( largestRegion, static_cast< unsigned int >( std::min(
+    std::max( numberOfBudgetPieces, static_cast< SizeValueType >( m_NumberOfStreamDivisions ) ),
+    static_cast< SizeValueType >( NumericTraits< unsigned int >::max() ) ) ) )};
+  MultiThreaderBase * const multiThreader {multithreaded ? this->GetMultiThreader() : nullptr};
+  if( multiThreader != nullptr )
+    {
+    multiThreader->SetNumberOfWorkUnits( this->GetNumberOfWorkUnits() );
+    }
+
+  // Progress is reported as each piece is sampled.
+  ProgressReporter progressReporter {progress != nullptr ? progress->filter : nullptr, 0, numberOfPieces, numberOfPieces,
+    progress != nullptr ? progress->start : 0.0f, progress != nullptr ? progress->weight : 1.0f};
 
   // To avoid zeros, every color intensity is incremented.
-  CalcMatrixType matrixV {numberOfRows, m_NumberOfColors};
-  for( iter.GoToBegin(); !iter.IsAtEnd(); ++iter )
+  CalcMatrixType &matrixV {samples.matrixV};
+  matrixV.resize( numberOfRows, m_NumberOfColors );
+  SizeValueType pieceStartOffset {0};
+  std::vector< StratumState > carriedStratum;
+  for( unsigned int piece {0}; piece < numberOfPieces; ++piece )
     {
-    if ( uniformGenerator->GetVariate() * numberOfPixels-- < numberOfRows )
+    RegionType pieceRegion {largestRegion};
+    splitter->GetSplit( piece, numberOfPieces, pieceRegion );
+    image->SetRequestedRegion( pieceRegion );
+    image->PropagateRequestedRegion();
+    image->UpdateOutputData();
+    // When the piece is a contiguous part of the buffer, the pixel at
+    // an offset is read directly from the buffer.
+    const PixelValueType * const pieceBuffer {Self::IsContiguous( pieceRegion, image->GetBufferedRegion() )
+      ? Self::BufferPointer( image, pieceRegion.GetIndex() ) : nullptr};
+
+    const SizeValueType pieceEndOffset {pieceStartOffset + pieceRegion.GetNumberOfPixels()};
+    const SizeValueType firstStratum {pieceStartOffset / numberOfPixelsPerStratum};
+    const SizeValueType lastStratum {( pieceEndOffset - 1 ) / numberOfPixelsPerStratum};
+    std::vector< StratumState > strata;
+    strata.reserve( lastStratum - firstStratum + 1 );
+    for( SizeValueType stratum {firstStratum}; stratum <= lastStratum; ++stratum )
       {
-      --numberOfRows;
-      PixelType pixelValue = iter.Get();
-      for( Eigen::Index color = 0; color < m_NumberOfColors; ++color )
+      strata.push_back( carriedStratum.empty() ? newStratumState( stratum ) : carriedStratum.front() );
+      carriedStratum.clear();
+      }
+
+    const auto sampleStratum = [&] ( SizeValueType stratum )
+      {
+      if( progress != nullptr && this->GetAbortGenerateData() )
+        {
+        // The samples will be discarded.
+        return;
+        }
+      StratumState &state {strata[stratum - firstStratum]};
+      const SizeValueType startOffset {std::max( stratum * numberOfPixelsPerStratum, pieceStartOffset )};
+      const SizeValueType endOffset {std::min( ( stratum + 1 ) * numberOfPixelsPerStratum, pieceEndOffset )};
+      if( m_RandomAccessSampling )
+        {
+        // Each cell has at least one pixel because a stratum has no
+        // more rows than pixels.
+        for( ; state.remainingRows > 0; --state.remainingRows, ++state.nextRow )
+          {
+          if( state.pendingOffset == numberOfPixels )
+            {
+            const SizeValueType cell {state.numberOfRows - state.remainingRows};
+            const SizeValueType cellStart {state.startOffset + cell * state.numberOfPixels / state.numberOfRows};
+            const SizeValueType cellSize {state.startOffset + ( cell + 1 ) * state.numberOfPixels / state.numberOfRows - cellStart};
+            state.pendingOffset = cellStart
+              + std::min( static_cast< SizeValueType >( state.uniformGenerator->GetVariate() * cellSize ), cellSize - 1 );
+            }
+          if( state.pendingOffset >= endOffset )
+            {
+            // This cell's pixel is in the next piece.
+            break;
+            }
+          if( pieceBuffer != nullptr )
+            {
+            const PixelValueType * const pixelValue {pieceBuffer + ( state.pendingOffset - pieceStartOffset ) * m_NumberOfDimensions};
+            for( Eigen::Index color = 0; color < m_NumberOfColors; ++color )
+              {
+              matrixV( state.nextRow, color ) = pixelValue[color] + CalcElementType( 1.0 );
+              }
+            }
+          else
+            {
+            const PixelType pixelValue = image->GetPixel( offsetToIndex( state.pendingOffset ) );
+            for( Eigen::Index color = 0; color < m_NumberOfColors; ++color )
+              {
+              matrixV( state.nextRow, color ) = pixelValue[color] + CalcElementType( 1.0 );
+              }
+            }
+          state.pendingOffset = numberOfPixels;
+          }
+        state.remainingPixels -= endOffset - startOffset;
+        return;
+        }
+      // Selection sampling: each pixel is chosen with the probability
+      // that the stratum's remaining rows fill its remaining pixels.
+      const auto selectPixel = [&state] () -> bool
+        {
+        if( state.uniformGenerator->GetVariate() * state.remainingPixels-- < state.remainingRows )
+          {
+          --state.remainingRows;
+          return true;
+          }
+        return false;
+        };
+      if( pieceBuffer != nullptr )
         {
-        matrixV( numberOfRows, color ) = pixelValue[color] + CalcElementType( 1.0 );
+        const PixelValueType *pixelValue {pieceBuffer + ( startOffset - pieceStartOffset ) * m_NumberOfDimensions};
+        for( SizeValueType offset {startOffset}; offset < endOffset; ++offset, pixelValue += m_NumberOfDimensions )
+          {
+          if( selectPixel() )
+            {
+            for( Eigen::Index color = 0; color < m_NumberOfColors; ++color )
+              {
+              matrixV( state.nextRow, color ) = pixelValue[color] + CalcElementType( 1.0 );
+              }
+            ++state.nextRow;
+            }
+          }
+        return;
         }
+      RegionConstIterator iter {image, pieceRegion};
+      iter.SetIndex( offsetToIndex( startOffset ) );
+      for( SizeValueType offset {startOffset}; offset < endOffset; ++offset, ++iter )
+        {
+        if( selectPixel() )
+          {
+          const PixelType pixelValue = iter.Get();
+          for( Eigen::Index color = 0; color < m_NumberOfColors; ++color )
+            {
+            matrixV( state.nextRow, color ) = pixelValue[color] + CalcElementType( 1.0 );
+            }
+          ++state.nextRow;
+          }
+        }
+      };
+    if( multiThreader != nullptr )
+      {
+      multiThreader->ParallelizeArray( firstStratum, lastStratum + 1, sampleStratum, nullptr );
+      }
+    else
+      {
+      for( SizeValueType stratum {firstStratum}; stratum <= lastStratum; ++stratum )
+        {
+        sampleStratum( stratum );
+        }
+      }
+    if( progress != nullptr )
+      {
+      this->CheckAbortGenerateData();
+      }
+    progressReporter.CompletedPixel();
+
+    if( strata.back().remainingPixels > 0 )
+      {
+      carriedStratum.push_back( strata.back() );
+      }
+    pieceStartOffset = pieceEndOffset;
+    }
+  image->SetRequestedRegion( requestedRegion );
+  image->PropagateRequestedRegion();
+  image->UpdateOutputData();
+
+  // Of the randomly chosen pixels, find those that are bright enough
+  // or dark enough to be useful.
+  this->MatrixToMatrixExtremes( samples );
+}
+
+
+// static method
+template< typename TImage, typename TCalcElement >
+ModifiedTimeType
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::ContentMTime( const ImageType *image )
+{
+  // An image produced by a pipeline changes only when something
+  // upstream of it does, which is what its PipelineMTime records.
+  // Its own MTime also advances each time its buffered pixels are
+  // regenerated, such as for each piece of a streamed pass.  An image
+  // that is not produced by a pipeline changes only when it is marked
+  // as modified.
+  return image->GetSource() != nullptr ? image->GetPipelineMTime() : image->GetMTime();
+}
+
+
+// static method
+template< typename TImage, typename TCalcElement >
+bool
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::IsContiguous( const RegionType &region, const RegionType &bufferedRegion )
+{
+  // Rows of the region follow one another in the buffer only if every
+  // dimension but the slowest spans the whole buffered region.
+  for( unsigned int dim {0}; dim + 1 < ImageType::ImageDimension; ++dim )
+    {
+    if( region.GetSize( dim ) != bufferedRegion.GetSize( dim ) )
+      {
+      return false;
       }
     }
+  return bufferedRegion.IsInside( region );
+}
 
-  // Of the randomly chosen pixels, keep only those that are bright
-  // enough or dark enough to be useful.
-  this->MatrixToMatrixExtremes( matrixV, matrixBrightV, matrixDarkV );
+
+// static method
+template< typename TImage, typename TCalcElement >
+auto
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::BufferPointer( const ImageType *image, const IndexType &index ) -> const PixelValueType *
+{
+  // Both an Image of fixed-length pixels and a VectorImage store the
+  // values of each pixel consecutively; the constructor checks that
+  // fixed-length pixels have no padding.
+  const SizeValueType numberOfDimensions {PixelHelper< PixelType >::NumberOfDimensions < 0
+    ? image->GetNumberOfComponentsPerPixel()
+    : static_cast< SizeValueType >( PixelHelper< PixelType >::NumberOfDimensions )};
+  return reinterpret_cast< const PixelValueType * >( image->GetBufferPointer() ) + image->ComputeOffset( index ) * numberOfDimensions;
 }
 
 
 // static method
-template< typename TImage >
+template< typename TImage, typename TCalcElement >
+auto
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::BufferPointer( ImageType *image, const IndexType &index ) -> PixelValueType *
+{
+  return const_cast< PixelValueType * >( Self::BufferPointer( static_cast< const ImageType * >( image ), index ) );
+}
+
+
+template< typename TImage, typename TCalcElement >
 void
-StructurePreservingColorNormalizationFilter< TImage >
-::MatrixToMatrixExtremes( const CalcMatrixType &matrixV, CalcMatrixType &matrixBrightV, CalcMatrixType &matrixDarkV )
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::MatrixToMatrixExtremes( SampleMatrix &samples ) const
 {
-  const CalcColVectorType intensityOfPixels {matrixV.rowwise().sum()};
+  CalcMatrixType &matrixV {samples.matrixV};
+  const Eigen::Index numberOfRows {matrixV.rows()};
 
-  // For finding the brightest pixels, find the specified percentile
-  // threshold.
-  CalcColVectorType brightRearranged {intensityOfPixels};
-  SizeValueType const brightPercentilePosition {static_cast< SizeValueType >( ( brightRearranged.size() - 1 ) * BrightPercentileLevel )};
-  std::nth_element( Self::begin( brightRearranged ), Self::begin( brightRearranged ) + brightPercentilePosition, Self::end( brightRearranged ) );
-  const CalcElementType brightPercentileThreshold {brightRearranged( brightPercentilePosition )};
+  // The intensity of each pixel is rearranged by nth_element, so the
+  // rows are summed again, in the same way, where they are needed.
+  CalcColVectorType intensityOfPixels {numberOfRows, 1};
+  for( Eigen::Index i = 0 ; i < numberOfRows; ++i )
+    {
+    intensityOfPixels( i ) = matrixV.row( i ).sum();
+    }
 
   // For finding the brightest pixels, find specified fraction of
   // maximum brightness.
-  const CalcElementType brightPercentageThreshold {BrightPercentageLevel * *std::max_element( Self::cbegin( intensityOfPixels ), Self::cend( intensityOfPixels ) )};
+  const CalcElementType brightPercentageThreshold {m_BrightPercentageLevel * *std::max_element( Self::cbegin( intensityOfPixels ), Self::cend( intensityOfPixels ) )};
+
+  // For finding the brightest pixels, find the specified percentile
+  // threshold.
+  SizeValueType const brightPercentilePosition {static_cast< SizeValueType >( ( numberOfRows - 1 ) * m_BrightPercentileLevel )};
+  std::nth_element( Self::begin( intensityOfPixels ), Self::begin( intensityOfPixels ) + brightPercentilePosition, Self::end( intensityOfPixels ) );
+  const CalcElementType brightPercentileThreshold {intensityOfPixels( brightPercentilePosition )};
 
   // For finding the brightest pixels, we will keep those pixels that
-  // pass at least one of the above bright thresholds.
+  // pass at least one of the above bright thresholds.  Every pixel is
+  // bright, dark, or both, because the bright threshold is no more
+  // than the dark threshold.
   const CalcElementType brightThreshold {std::min( brightPercentileThreshold, brightPercentageThreshold )};
   const CalcElementType darkThreshold { brightPercentageThreshold };
+  const auto groupOfRow = [&matrixV, brightThreshold, darkThreshold] ( Eigen::Index i ) -> int
+    {
+    const CalcElementType intensity {matrixV.row( i ).sum()};
+    return intensity < brightThreshold ? 0 : intensity <= darkThreshold ? 1 : 2;
+    };
 
-  SizeValueType numberOfBrightRows {0};
-  SizeValueType numberOfDarkRows {0};
-  for( Eigen::Index i = 0 ; i < matrixV.rows(); ++i )
+  // Move the rows that are only dark to the front and the rows that
+  // are only bright to the back, keeping the order of the rows within
+  // each group.  The permutation is applied in place.
+  std::array< Eigen::Index, 3 > nextRowOfGroup {{0, 0, 0}};
+  for( Eigen::Index i = 0 ; i < numberOfRows; ++i )
     {
-    if( intensityOfPixels( i ) >= brightThreshold )
-      {
-      ++numberOfBrightRows;
-      }
-    if( intensityOfPixels( i ) <= darkThreshold )
-      {
-      ++numberOfDarkRows;
-      }
+    ++nextRowOfGroup[groupOfRow( i )];
     }
-  matrixBrightV = CalcMatrixType {numberOfBrightRows, matrixV.cols()};
-  numberOfBrightRows = 0;
-  matrixDarkV = CalcMatrixType {numberOfDarkRows, matrixV.cols()};
-  numberOfDarkRows = 0;
-  for( Eigen::Index i = 0 ; i < matrixV.rows(); ++i )
+  samples.firstBrightRow = nextRowOfGroup[0];
+  samples.endOfDarkRows = nextRowOfGroup[0] + nextRowOfGroup[1];
+  nextRowOfGroup = {{0, samples.firstBrightRow, samples.endOfDarkRows}};
+  Eigen::PermutationMatrix< Eigen::Dynamic, Eigen::Dynamic, Eigen::Index > permutation {numberOfRows};
+  for( Eigen::Index i = 0 ; i < numberOfRows; ++i )
     {
-    if( intensityOfPixels( i ) >= brightThreshold )
-      {
-      matrixBrightV.row( numberOfBrightRows++ ) = matrixV.row( i );
-      }
-    if( intensityOfPixels( i ) <= darkThreshold )
-      {
-      matrixDarkV.row( numberOfDarkRows++ ) = matrixV.row( i );
-      }
+    permutation.indices()( i ) = nextRowOfGroup[groupOfRow( i )]++;
     }
+  matrixV = permutation * matrixV;
 }
 
 
-// static method
-template< typename TImage >
+template< typename TImage, typename TCalcElement >
 void
-StructurePreservingColorNormalizationFilter< TImage >
-::MatrixToDistinguishers( const CalcMatrixType &matrixV, CalcMatrixType &distinguishers )
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::MatrixToDistinguishers( const CalcMatrixConstRefType &matrixV, CalcMatrixType &distinguishers ) const
 {
-  const CalcMatrixType normVStart {matrixV};
-
   // We will store the row ( pixel ) index of each distinguishing
   // pixel in firstPassDistinguisherIndices.
   std::array< int, NumberOfStains+1 > firstPassDistinguisherIndices {-1};
   SizeValueType numberOfDistinguishers {0};
-  Self::FirstPassDistinguishers( normVStart, firstPassDistinguisherIndices, numberOfDistinguishers );
+  Self::FirstPassDistinguishers( matrixV, firstPassDistinguisherIndices, numberOfDistinguishers );
 
   // Each row of secondPassDistinguisherColors is the vector of color
   // values for a distinguisher.
   CalcMatrixType secondPassDistinguisherColors {numberOfDistinguishers, matrixV.cols()};
-  Self::SecondPassDistinguishers( normVStart, firstPassDistinguisherIndices, numberOfDistinguishers, secondPassDistinguisherColors );
+  this->SecondPassDistinguishers( matrixV, firstPassDistinguisherIndices, numberOfDistinguishers, secondPassDistinguisherColors );
 
   distinguishers = secondPassDistinguisherColors;
 }
 
 
 // static method
-template< typename TImage >
+template< typename TImage, typename TCalcElement >
 void
-StructurePreservingColorNormalizationFilter< TImage >
-::FirstPassDistinguishers( const CalcMatrixType &normVStart, std::array< int, NumberOfStains+1 > &firstPassDistinguisherIndices, SizeValueType &numberOfDistinguishers )
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::FirstPassDistinguishers( const CalcMatrixConstRefType &matrixV, std::array< int, NumberOfStains+1 > &firstPassDistinguisherIndices, SizeValueType &numberOfDistinguishers )
 {
-  CalcMatrixType normV {normVStart};
+  DistinguisherProjection projection {Self::NewDistinguisherProjection( matrixV.cols() )};
+  CalcRowVectorType scratchRow {1, matrixV.cols()};
   numberOfDistinguishers = 0;
-  bool needToRecenterMatrix = true;
   while( numberOfDistinguishers <= NumberOfStains )
     {
     // Find the next distinguishing row ( pixel )
-    firstPassDistinguisherIndices[numberOfDistinguishers] = Self::MatrixToOneDistinguisher( normV );
+    firstPassDistinguisherIndices[numberOfDistinguishers] = Self::MatrixToOneDistinguisher( matrixV, projection, scratchRow );
     // If we found a distinguisher and we have not yet found
     // NumberOfStains+1 of them, then look for the next distinguisher.
     if( firstPassDistinguisherIndices[numberOfDistinguishers] >= 0 )
@@ -390,15 +1523,7 @@ StructurePreservingColorNormalizationFilter< TImage >
       if( numberOfDistinguishers <= NumberOfStains )
         {
         // Prepare to look for the next distinguisher
-        if( needToRecenterMatrix )
-          {
-          normV = Self::RecenterMatrix( normV, firstPassDistinguisherIndices[numberOfDistinguishers - 1] );
-          needToRecenterMatrix = false;
-          }
-        else
-          {
-          normV = Self::ProjectMatrix( normV, firstPassDistinguisherIndices[numberOfDistinguishers - 1] );
-          }
+        Self::AddToProjection( matrixV, firstPassDistinguisherIndices[numberOfDistinguishers - 1], projection, scratchRow );
         }
       }
     else
@@ -410,47 +1535,47 @@ StructurePreservingColorNormalizationFilter< TImage >
 }
 
 
-// static method
-template< typename TImage >
+template< typename TImage, typename TCalcElement >
 void
-StructurePreservingColorNormalizationFilter< TImage >
-::SecondPassDistinguishers( const CalcMatrixType &normVStart, const std::array< int, NumberOfStains+1 > &firstPassDistinguisherIndices, const SizeValueType numberOfDistinguishers,
-  CalcMatrixType &secondPassDistinguisherColors )
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::SecondPassDistinguishers( const CalcMatrixConstRefType &matrixV, const std::array< int, NumberOfStains+1 > &firstPassDistinguisherIndices, const SizeValueType numberOfDistinguishers,
+  CalcMatrixType &secondPassDistinguisherColors ) const
 {
+  CalcRowVectorType scratchRow {1, matrixV.cols()};
+  CalcRowVectorType selfRow {1, matrixV.cols()};
+  CalcColVectorType dotProducts {matrixV.rows()};
   for( int distinguisher {0}; distinguisher < numberOfDistinguishers; ++distinguisher )
     {
-    CalcMatrixType normV {normVStart};
-    bool needToRecenterMatrix = true;
+    DistinguisherProjection projection {Self::NewDistinguisherProjection( matrixV.cols() )};
     for( int otherDistinguisher {0}; otherDistinguisher < numberOfDistinguishers; ++otherDistinguisher )
       {
       // skip if self
       if( otherDistinguisher != distinguisher )
         {
-        if( needToRecenterMatrix )
-          {
-          normV = Self::RecenterMatrix( normV, firstPassDistinguisherIndices[otherDistinguisher] );
-          needToRecenterMatrix = false;
-          }
-        else
-          {
-          normV = Self::ProjectMatrix( normV, firstPassDistinguisherIndices[otherDistinguisher] );
-          }
+        Self::AddToProjection( matrixV, firstPassDistinguisherIndices[otherDistinguisher], projection, scratchRow );
         }
       }
     // We have sent all distinguishers except self to the origin.
     // Whatever is far from the origin in the same direction as self
     // is a good replacement for self.  We will take an average among
     // those that are at least 80% as far as the best.  ( Note that
-    // self could still be best, but not always. )
-    const CalcColVectorType dotProducts {normV * normV.row( firstPassDistinguisherIndices[distinguisher] ).transpose()};
-    const CalcElementType threshold {*std::max_element( Self::cbegin( dotProducts ), Self::cend( dotProducts ) ) * SecondPassDistinguishersThreshold};
-    CalcRowVectorType cumulative {CalcRowVectorType::Constant( 1, normVStart.cols(), 0.0 )};
+    // self could still be best, but not always. )  Because the
+    // projection is orthogonal, the dot product of a projected row
+    // with projected self is that of the recentered row with
+    // projected self.
+    Self::ProjectRow( matrixV, firstPassDistinguisherIndices[distinguisher], projection, selfRow );
+    for( Eigen::Index row = 0; row < matrixV.rows(); ++row )
+      {
+      dotProducts( row ) = ( matrixV.row( row ) - projection.center ).dot( selfRow );
+      }
+    const CalcElementType threshold {*std::max_element( Self::cbegin( dotProducts ), Self::cend( dotProducts ) ) * m_SecondPassDistinguishersThreshold};
+    CalcRowVectorType cumulative {CalcRowVectorType::Constant( 1, matrixV.cols(), 0.0 )};
     SizeValueType numberOfContributions {0};
     for( Eigen::Index row = 0; row < dotProducts.size(); ++row )
       {
       if( dotProducts( row ) >= threshold )
         {
-        cumulative += normVStart.row( row );
+        cumulative += matrixV.row( row );
         ++numberOfContributions;
         }
       }
@@ -460,48 +1585,80 @@ StructurePreservingColorNormalizationFilter< TImage >
 
 
 // static method
-template< typename TImage >
-int
-StructurePreservingColorNormalizationFilter< TImage >
-::MatrixToOneDistinguisher( const CalcMatrixType &normV )
+template< typename TImage, typename TCalcElement >
+auto
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::NewDistinguisherProjection( Eigen::Index numberOfColors ) -> DistinguisherProjection
+{
+  // Until a center is set, the center is the origin.
+  return DistinguisherProjection {CalcRowVectorType::Zero( 1, numberOfColors ), CalcMatrixType {static_cast< Eigen::Index >( NumberOfStains ), numberOfColors}, -1};
+}
+
+
+// static method
+template< typename TImage, typename TCalcElement >
+void
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::ProjectRow( const CalcMatrixConstRefType &matrixV, const Eigen::Index row, const DistinguisherProjection &projection, CalcRowVectorType &projectedRow )
 {
-  const CalcColVectorType lengths2 = normV.rowwise().squaredNorm();
-  const CalcElementType * const result {std::max_element( Self::cbegin( lengths2 ), Self::cend( lengths2 ) )};
-  if( *result > epsilon2 )
-    {
-    return std::distance( Self::cbegin( lengths2 ), result );
-    }
-  else
+  // projectedRow already has the right size, so nothing is allocated.
+  projectedRow = matrixV.row( row ) - projection.center;
+  for( Eigen::Index direction {0}; direction < projection.numberOfDirections; ++direction )
     {
-    return -1;                // Nothing left to find
+    projectedRow -= projectedRow.dot( projection.directions.row( direction ) ) * projection.directions.row( direction );
     }
 }
 
 
 // static method
-template< typename TImage >
-typename StructurePreservingColorNormalizationFilter< TImage >::CalcMatrixType
-StructurePreservingColorNormalizationFilter< TImage >
-::RecenterMatrix( const CalcMatrixType &normV, const SizeValueType row )
+template< typename TImage, typename TCalcElement >
+void
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::AddToProjection( const CalcMatrixConstRefType &matrixV, const Eigen::Index row, DistinguisherProjection &projection, CalcRowVectorType &scratchRow )
 {
-  return CalcMatrixType( normV.rowwise() - normV.row ( row ) );
+  // The first distinguisher added becomes the center.  Each later one,
+  // as transformed so far, becomes a direction to project away.
+  if( projection.numberOfDirections < 0 )
+    {
+    projection.center = matrixV.row( row );
+    projection.numberOfDirections = 0;
+    }
+  else
+    {
+    Self::ProjectRow( matrixV, row, projection, scratchRow );
+    projection.directions.row( projection.numberOfDirections ) = scratchRow / scratchRow.norm();
+    ++projection.numberOfDirections;
+    }
 }
 
 
 // static method
-template< typename TImage >
-typename StructurePreservingColorNormalizationFilter< TImage >::CalcMatrixType
-StructurePreservingColorNormalizationFilter< TImage >
-::ProjectMatrix( const CalcMatrixType &normV, const SizeValueType row )
+template< typename TImage, typename TCalcElement >
+int
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::MatrixToOneDistinguisher( const CalcMatrixConstRefType &matrixV, const DistinguisherProjection &projection, CalcRowVectorType &scratchRow )
 {
-  const CalcRowVectorType rowValue {normV.row( row )};
-  return normV - ( normV * rowValue.transpose() ) * ( rowValue / rowValue.squaredNorm() );
+  // The row that is farthest from the origin once transformed by the
+  // projection.  Ties go to the first such row.
+  int result {-1};
+  CalcElementType largest {epsilon2};
+  for( Eigen::Index row {0}; row < matrixV.rows(); ++row )
+    {
+    Self::ProjectRow( matrixV, row, projection, scratchRow );
+    const CalcElementType length2 {scratchRow.squaredNorm()};
+    if( length2 > largest )
+      {
+      largest = length2;
+      result = static_cast< int >( row );
+      }
+    }
+  return result;                // -1 if there is nothing left to find
 }
 
 
-template< typename TImage >
+template< typename TImage, typename TCalcElement >
 int
-StructurePreservingColorNormalizationFilter< TImage >
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
 ::DistinguishersToNMFSeeds( const CalcMatrixType &distinguishers, CalcRowVectorType &unstainedPixel, CalcMatrixType &matrixH ) const
 {
   matrixH = CalcMatrixType {NumberOfStains, m_NumberOfColors};
@@ -540,9 +1697,9 @@ StructurePreservingColorNormalizationFilter< TImage >
 }
 
 
-template< typename TImage >
+template< typename TImage, typename TCalcElement >
 void
-StructurePreservingColorNormalizationFilter< TImage >
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
 ::DistinguishersToColors( CalcMatrixType const &distinguishers, SizeValueType &unstainedIndex, SizeValueType &hematoxylinIndex, SizeValueType &eosinIndex ) const
 {
   // Figure out which, distinguishers are unstained ( highest
@@ -566,56 +1723,256 @@ StructurePreservingColorNormalizationFilter< TImage >
 }
 
 
-template< typename TImage >
+template< typename TImage, typename TCalcElement >
+MultiThreaderBase::Pointer
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::NewEstimationMultiThreader() const
+{
+  const MultiThreaderBase::Pointer multiThreader {dynamic_cast< MultiThreaderBase * >( this->GetMultiThreader()->CreateAnother().GetPointer() )};
+  itkAssertOrThrowMacro( multiThreader.IsNotNull(), "The filter's multithreader could not be copied" );
+  return multiThreader;
+}
+
+
+template< typename TImage, typename TCalcElement >
+void
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::ParallelizeIndices( SizeValueType numberOfIndices, MultiThreaderBase *multiThreader,
+  const MultiThreaderBase::ArrayThreadingFunctorType &function ) const
+{
+  if( multiThreader != nullptr && numberOfIndices > 1 )
+    {
+    multiThreader->SetNumberOfWorkUnits( std::min( static_cast< SizeValueType >( this->GetNumberOfWorkUnits() ), numberOfIndices ) );
+    multiThreader->ParallelizeArray( 0, numberOfIndices, function, nullptr );
+    }
+  else
+    {
+    for( SizeValueType index {0}; index < numberOfIndices; ++index )
+      {
+      function( index );
+      }
+    }
+}
+
+
+template< typename TImage, typename TCalcElement >
+template< typename TBlockFunction >
+void
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::ParallelizeSampleRows( Eigen::Index numberOfRows, MultiThreaderBase *multiThreader, const TBlockFunction &blockFunction ) const
+{
+  const Eigen::Index numberOfRowsPerBlock {static_cast< Eigen::Index >( numberOfSampleRowsPerBlock )};
+  const SizeValueType numberOfBlocks {static_cast< SizeValueType >( ( numberOfRows + numberOfRowsPerBlock - 1 ) / numberOfRowsPerBlock )};
+  this->ParallelizeIndices( numberOfBlocks, multiThreader, [numberOfRows, numberOfRowsPerBlock, &blockFunction] ( SizeValueType block )
+    {
+    const Eigen::Index firstRow {static_cast< Eigen::Index >( block ) * numberOfRowsPerBlock};
+    blockFunction( firstRow, std::min( numberOfRowsPerBlock, numberOfRows - firstRow ) );
+    } );
+}
+
+
+template< typename TImage, typename TCalcElement >
 void
-StructurePreservingColorNormalizationFilter< TImage >
-::NormalizeMatrixH( const CalcMatrixType &matrixDarkVIn, const CalcRowVectorType &unstainedPixel, CalcMatrixType &matrixH ) const
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::MatricesToInitialW( const CalcMatrixConstRefType &matrixV, const CalcMatrixType &matrixH, CalcMatrixType &matrixW,
+  MultiThreaderBase *multiThreader ) const
 {
-  const CalcColVectorType firstOnes {CalcColVectorType::Constant( matrixDarkVIn.rows(), 1, 1.0 )};
+  const auto clip = [] ( const CalcElementType &x )
+    {
+    return std::max( CalcElementType( 0.0 ), x );
+    };
+  const CalcMatrixType matrixHTranspose {matrixH.transpose()};
+  const CalcMatrixType gramHInverse {( matrixH * matrixH.transpose() ).inverse()};
+  matrixW.resize( matrixV.rows(), matrixH.rows() );
+  this->ParallelizeSampleRows( matrixV.rows(), multiThreader, [&matrixV, &matrixHTranspose, &gramHInverse, &matrixW, &clip] ( Eigen::Index firstRow, Eigen::Index numberOfBlockRows )
+    {
+    matrixW.middleRows( firstRow, numberOfBlockRows ) = ( ( ( ( matrixV.middleRows( firstRow, numberOfBlockRows ) * matrixHTranspose ).array() - lambda ).unaryExpr( clip )
+      + epsilon2 ).matrix() * gramHInverse ).unaryExpr( clip );
+    } );
+}
 
+
+template< typename TImage, typename TCalcElement >
+void
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::NormalizeMatrixH( const CalcMatrixConstRefType &matrixDarkVIn, const CalcRowVectorType &unstainedPixel, CalcMatrixType &matrixH,
+  MultiThreaderBase *multiThreader ) const
+{
   // Compute the VeryDarkPercentileLevel percentile of a stain's
   // negative( matrixW ) column.  This a dark value due to its being the
-  // ( 100 - VeryDarkPercentileLevel ) among quantities of stain.
-  CalcRowVectorType logUnstainedCalcPixel = unstainedPixel.unaryExpr( CalcUnaryFunctionPointer( std::log ) );
-  CalcMatrixType matrixDarkV {matrixDarkVIn};
-  matrixDarkV = ( firstOnes * logUnstainedCalcPixel ) - matrixDarkV.unaryExpr( CalcUnaryFunctionPointer( std::log ) );
+  // ( 100 - VeryDarkPercentileLevel ) among quantities of stain.  Each
+  // row of negative( matrixW ) depends only upon the same row of
+  // matrixDarkVIn, so the rows are computed in blocks, and then each
+  // stain's percentile is selected by its own work unit.
+  const CalcRowVectorType logUnstainedCalcPixel = unstainedPixel.unaryExpr( CalcUnaryFunctionPointer( std::log ) );
+  const CalcMatrixType matrixHTranspose {matrixH.transpose()};
+  const CalcMatrixType gramHInverse {( matrixH * matrixH.transpose() ).inverse()};
 
   const auto clip = [] ( const CalcElementType &x )
     {
     return std::max( CalcElementType( 0.0 ), x );
     };
-  CalcMatrixType negativeMatrixW = -( ( ( matrixDarkV * matrixH.transpose() ).array() - lambda ).unaryExpr( clip ).matrix() * ( matrixH * matrixH.transpose() ).inverse() ).unaryExpr( clip );
-  for( Eigen::Index stain = 0; stain < NumberOfStains; ++stain )
+  CalcMatrixType negativeMatrixW {matrixDarkVIn.rows(), matrixH.rows()};
+  this->ParallelizeSampleRows( matrixDarkVIn.rows(), multiThreader,
+    [&matrixDarkVIn, &logUnstainedCalcPixel, &matrixHTranspose, &gramHInverse, &negativeMatrixW, &clip] ( Eigen::Index firstRow, Eigen::Index numberOfBlockRows )
     {
-    CalcColVectorType columnW {negativeMatrixW.col( stain )};
+    const CalcMatrixType blockDarkV {( -matrixDarkVIn.middleRows( firstRow, numberOfBlockRows ).unaryExpr( CalcUnaryFunctionPointer( std::log ) ) ).rowwise()
+      + logUnstainedCalcPixel};
+    negativeMatrixW.middleRows( firstRow, numberOfBlockRows ) = -( ( ( blockDarkV * matrixHTranspose ).array() - lambda ).unaryExpr( clip ).matrix()
+      * gramHInverse ).unaryExpr( clip );
+    } );
+
+  CalcColVectorType veryDarkPercentileThresholds {matrixH.rows()};
+  this->ParallelizeIndices( NumberOfStains, multiThreader, [this, &negativeMatrixW, &veryDarkPercentileThresholds] ( SizeValueType stain )
+    {
+    CalcColVectorType columnW {negativeMatrixW.col( static_cast< Eigen::Index >( stain ) )};
     SizeValueType const veryDarkPercentilePosition
-      {static_cast< SizeValueType >( ( columnW.size() - 1 ) * VeryDarkPercentileLevel )};
+      {static_cast< SizeValueType >( ( columnW.size() - 1 ) * m_VeryDarkPercentileLevel )};
     std::nth_element( Self::begin( columnW ), Self::begin( columnW ) + veryDarkPercentilePosition, Self::end( columnW ) );
-    const CalcElementType VeryDarkPercentileThreshold {-columnW( veryDarkPercentilePosition )};
-    matrixH.row( stain ) *= VeryDarkPercentileThreshold;
+    veryDarkPercentileThresholds( static_cast< Eigen::Index >( stain ) ) = -columnW( veryDarkPercentilePosition );
+    } );
+  for( Eigen::Index stain = 0; stain < NumberOfStains; ++stain )
+    {
+    matrixH.row( stain ) *= veryDarkPercentileThresholds( stain );
     }
 }
 
 
-// static method
-template< typename TImage >
-void
-StructurePreservingColorNormalizationFilter< TImage >
-::VirtanenNMFEuclidean( const CalcMatrixType &matrixV, CalcMatrixType &matrixW, CalcMatrixType &matrixH )
+template< typename TImage, typename TCalcElement >
+typename StructurePreservingColorNormalizationFilter< TImage, TCalcElement >::SizeValueType
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::HALSNMFEuclidean( const CalcMatrixConstRefType &matrixV, CalcMatrixType &matrixW, CalcMatrixType &matrixH,
+  const EstimationProgress *progress, MultiThreaderBase *multiThreader ) const
 {
+  // Hierarchical alternating least squares minimizes the same
+  // objective as VirtanenNMFEuclidean, | matrixV - matrixW * matrixH
+  // |^2 with the Lasso penalty lambda on matrixW, but updates one
+  // column of matrixW or one row of matrixH at a time, each to its
+  // non-negative least squares optimum with the others held fixed.
+  // Because matrixH has only NumberOfStains rows, each iteration
+  // needs only one pass over the rows of matrixV: each row of matrixW
+  // is updated from its row of matrixV and the small Gram matrix
+  // matrixH * matrixH^T, and that same row contributes to
+  // matrixW^T * matrixV and matrixW^T * matrixW, from which matrixH
+  // is then updated.
   const auto clip = [] ( const CalcElementType &x )
     {
     return std::max( CalcElementType( 0.0 ), x );
     };
-  matrixW = ( ( ( ( matrixV * matrixH.transpose() ).array() - lambda ).unaryExpr( clip ) + epsilon2 ).matrix() * ( matrixH * matrixH.transpose() ).inverse() ).unaryExpr( clip );
+  this->MatricesToInitialW( matrixV, matrixH, matrixW, multiThreader );
+
+  const Eigen::Index numberOfRows {matrixV.rows()};
+  const Eigen::Index numberOfColors {matrixV.cols()};
+  constexpr Eigen::Index numberOfStains {static_cast< Eigen::Index >( NumberOfStains )};
+  ProgressReporter progressReporter {progress != nullptr ? progress->filter : nullptr, 0, m_MaximumNumberOfIterations, 100,
+    progress != nullptr ? progress->start : 0.0f, progress != nullptr ? progress->weight : 1.0f};
+  SizeValueType loopIter {0};
+  while( loopIter < m_MaximumNumberOfIterations )
+    {
+    if( progress != nullptr )
+      {
+      this->CheckAbortGenerateData();
+      }
+    progressReporter.CompletedPixel();
+    ++loopIter;
+    const CalcMatrixType previousMatrixH {matrixH};
+    const CalcMatrixType gramH {matrixH * matrixH.transpose()};
+    CalcMatrixType productWTV {CalcMatrixType::Zero( numberOfStains, numberOfColors )};
+    CalcMatrixType gramW {CalcMatrixType::Zero( numberOfStains, numberOfStains )};
+    // Local pointers, because the compiler must otherwise assume that
+    // each store to matrixW could change the matrices' storage.
+    const CalcElementType * const dataH {matrixH.data()};
+    const CalcElementType * const dataGramH {gramH.data()};
+    CalcElementType * const dataWTV {productWTV.data()};
+    CalcElementType * const dataGramW {gramW.data()};
+    CalcElementType largestChange {0.0};
+    for( Eigen::Index row {0}; row < numberOfRows; ++row )
+      {
+      const CalcElementType * const rowV {matrixV.data() + row * matrixV.outerStride()};
+      CalcElementType * const rowW {matrixW.data() + row * numberOfStains};
+      for( Eigen::Index stain {0}; stain < numberOfStains; ++stain )
+        {
+        CalcElementType productVHT {-lambda};
+        for( Eigen::Index color {0}; color < numberOfColors; ++color )
+          {
+          productVHT += rowV[color] * dataH[stain * numberOfColors + color];
+          }
+        for( Eigen::Index other {0}; other < numberOfStains; ++other )
+          {
+          productVHT -= rowW[other] * dataGramH[other * numberOfStains + stain];
+          }
+        const CalcElementType updated {clip( rowW[stain] + productVHT / ( dataGramH[stain * numberOfStains + stain] + epsilon2 ) )};
+        largestChange = std::max( largestChange, std::abs( updated - rowW[stain] ) );
+        rowW[stain] = updated;
+        }
+      for( Eigen::Index stain {0}; stain < numberOfStains; ++stain )
+        {
+        for( Eigen::Index color {0}; color < numberOfColors; ++color )
+          {
+          dataWTV[stain * numberOfColors + color] += rowW[stain] * rowV[color];
+          }
+        for( Eigen::Index other {0}; other < numberOfStains; ++other )
+          {
+          dataGramW[stain * numberOfStains + other] += rowW[stain] * rowW[other];
+          }
+        }
+      }
+    for( Eigen::Index stain {0}; stain < numberOfStains; ++stain )
+      {
+      matrixH.row( stain ) = ( matrixH.row( stain )
+        + ( productWTV.row( stain ) - gramW.row( stain ) * matrixH ) / ( gramW( stain, stain ) + epsilon2 ) ).unaryExpr( clip );
+      }
+    // Renormalize rows of matrixH to have unit magnitude, scaling the
+    // columns of matrixW to leave their product unchanged.
+    const CalcRowVectorType norms {CalcRowVectorType( matrixH.rowwise().squaredNorm().transpose() ).unaryExpr( CalcUnaryFunctionPointer( std::sqrt ) )};
+    if( ( norms.array() <= epsilon2 ).any() )
+      {
+      // A stain has vanished; keep the previous estimate.
+      matrixH = previousMatrixH;
+      break;
+      }
+    matrixH = norms.asDiagonal().inverse() * matrixH;
+    matrixW = matrixW * norms.asDiagonal();
+    if( largestChange < m_ConvergenceThreshold )
+      {
+      break;
+      }
+    }
+
+  // Round off values in the response, so that numbers are quite small
+  // are set to zero.
+  const CalcElementType maxW = matrixW.template lpNorm< Eigen::Infinity >() * 15;
+  matrixW = ( ( matrixW.array() + maxW ) - maxW ).matrix();
+  return loopIter;
+}
+
+
+template< typename TImage, typename TCalcElement >
+typename StructurePreservingColorNormalizationFilter< TImage, TCalcElement >::SizeValueType
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::VirtanenNMFEuclidean( const CalcMatrixConstRefType &matrixV, CalcMatrixType &matrixW, CalcMatrixType &matrixH,
+  const EstimationProgress *progress, MultiThreaderBase *multiThreader ) const
+{
+  const auto clip = [] ( const CalcElementType &x )
+    {
+    return std::max( CalcElementType( 0.0 ), x );
+    };
+  this->MatricesToInitialW( matrixV, matrixH, matrixW, multiThreader );
 
   // Apply Virtanen's algorithm to iteratively improve matrixW and
   // matrixH.  Note that parentheses optimize the order of matrix
   // chain multiplications and affect the speed of this method.
   CalcMatrixType previousMatrixW {matrixW};
+  ProgressReporter progressReporter {progress != nullptr ? progress->filter : nullptr, 0, m_MaximumNumberOfIterations, 100,
+    progress != nullptr ? progress->start : 0.0f, progress != nullptr ? progress->weight : 1.0f};
   SizeValueType loopIter {0};
-  for( ; loopIter < maxNumberOfIterations; ++loopIter )
+  for( ; loopIter < m_MaximumNumberOfIterations; ++loopIter )
     {
+    if( progress != nullptr )
+      {
+      this->CheckAbortGenerateData();
+      }
+    progressReporter.CompletedPixel();
     // Lasso term "lambda" insertion is possibly in a novel way.
     matrixW = (
       matrixW.array()
@@ -630,8 +1987,9 @@ StructurePreservingColorNormalizationFilter< TImage >
     matrixH = CalcRowVectorType( matrixH.rowwise().squaredNorm() ).unaryExpr( CalcUnaryFunctionPointer( std::sqrt ) ).asDiagonal().inverse() * matrixH;
     if( ( loopIter & 15 ) == 15 )
       {
-      if( ( matrixW - previousMatrixW ).lpNorm< Eigen::Infinity >() < epsilon0 )
+      if( ( matrixW - previousMatrixW ).template lpNorm< Eigen::Infinity >() < m_ConvergenceThreshold )
         {
+        ++loopIter;
         break;
         }
       previousMatrixW = matrixW;
@@ -641,16 +1999,16 @@ StructurePreservingColorNormalizationFilter< TImage >
 
   // Round off values in the response, so that numbers are quite small
   // are set to zero.
-  const CalcElementType maxW = matrixW.lpNorm< Eigen::Infinity >() * 15;
+  const CalcElementType maxW = matrixW.template lpNorm< Eigen::Infinity >() * 15;
   matrixW = ( ( matrixW.array() + maxW ) - maxW ).matrix();
+  return loopIter;
 }
 
 
-// static method
-template< typename TImage >
-void
-StructurePreservingColorNormalizationFilter< TImage >
-::VirtanenNMFKLDivergence( const CalcMatrixType &matrixV, CalcMatrixType &matrixW, CalcMatrixType &matrixH )
+template< typename TImage, typename TCalcElement >
+typename StructurePreservingColorNormalizationFilter< TImage, TCalcElement >::SizeValueType
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::VirtanenNMFKLDivergence( const CalcMatrixConstRefType &matrixV, CalcMatrixType &matrixW, CalcMatrixType &matrixH ) const
 {
   // If this method is going to get used, we may need to incorporate
   // the Lasso penalty lambda for matrixW and incorporate the Lagrange
@@ -668,7 +2026,7 @@ StructurePreservingColorNormalizationFilter< TImage >
   const CalcColVectorType lastOnes {CalcColVectorType::Constant( matrixV.cols(), 1, 1.0 )};
   CalcMatrixType previousMatrixW {matrixW};
   SizeValueType loopIter {0};
-  for( ; loopIter < maxNumberOfIterations; ++loopIter )
+  for( ; loopIter < m_MaximumNumberOfIterations; ++loopIter )
     {
     matrixW = (
       matrixW.array()
@@ -683,8 +2041,11 @@ StructurePreservingColorNormalizationFilter< TImage >
     matrixH = CalcRowVectorType( matrixH.rowwise().squaredNorm() ).unaryExpr( CalcUnaryFunctionPointer( std::sqrt ) ).asDiagonal().inverse() * matrixH;
     if( ( loopIter & 15 ) == 15 )
       {
-      if( ( matrixW - previousMatrixW ).lpNorm< Eigen::Infinity >() < epsilon0 )
+      if( ( matrixW - previousMatrixW ).template lpNorm< Eigen::Infinity >() < m_ConvergenceThreshold )
+        {
+        ++loopIter;
         break;
+        }
       previousMatrixW = matrixW;
       }
     }
@@ -692,115 +2053,564 @@ StructurePreservingColorNormalizationFilter< TImage >
 
   // Round off values in the response, so that numbers are quite small
   // are set to zero.
-  const CalcElementType maxW = matrixW.lpNorm< Eigen::Infinity >() * 15;
+  const CalcElementType maxW = matrixW.template lpNorm< Eigen::Infinity >() * 15;
   matrixW = ( ( matrixW.array() + maxW ) - maxW ).matrix();
+  return loopIter;
 }
 
 
-template< typename TImage >
+template< typename TImage, typename TCalcElement >
+typename StructurePreservingColorNormalizationFilter< TImage, TCalcElement >::PixelTransformCoefficients
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::TransformModelToCoefficients( const TransformModel &model )
+{
+  // CalcMatrixType and CalcRowVectorType are row major, so their data
+  // are already in the documented order.
+  const auto flatten = [] ( const CalcElementType *data, Eigen::Index size )
+    {
+    return std::vector< CalcElementType >( data, data + size );
+    };
+  PixelTransformCoefficients coefficients;
+  coefficients.numberOfColors = static_cast< SizeValueType >( model.referenceH.cols() );
+  coefficients.numberOfStains = static_cast< SizeValueType >( model.referenceH.rows() );
+  coefficients.inputHTranspose = flatten( model.inputHTranspose.data(), model.inputHTranspose.size() );
+  coefficients.inputHHTransposeInverse = flatten( model.inputHHTransposeInverse.data(), model.inputHHTransposeInverse.size() );
+  coefficients.referenceH = flatten( model.referenceH.data(), model.referenceH.size() );
+  coefficients.logInputUnstained = flatten( model.logInputUnstained.data(), model.logInputUnstained.size() );
+  coefficients.logReferenceUnstained = flatten( model.logReferenceUnstained.data(), model.logReferenceUnstained.size() );
+  coefficients.lowerbound = model.lowerbound;
+  coefficients.upperbound = model.upperbound;
+  coefficients.skipBackground = model.skipBackground;
+  coefficients.backgroundLowerbound = flatten( model.backgroundLowerbound.data(), model.backgroundLowerbound.size() );
+  coefficients.backgroundPixel = flatten( model.backgroundPixel.data(), model.backgroundPixel.size() );
+  return coefficients;
+}
+
+
+template< typename TImage, typename TCalcElement >
 void
-StructurePreservingColorNormalizationFilter< TImage >
-::NMFsToImage( const CalcMatrixType &inputH, const CalcRowVectorType &inputUnstained, const CalcMatrixType &referenceH, const CalcRowVectorType &referenceUnstained,
-  RegionIterator &outIt ) const
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::NMFsToTransformModel( const CalcMatrixType &inputH, const CalcRowVectorType &inputUnstained, const CalcMatrixType &referenceH, const CalcRowVectorType &referenceUnstained,
+  TransformModel &model ) const
+{
+  model.inputHTranspose = inputH.transpose();
+  model.inputHHTransposeInverse = ( inputH * inputH.transpose() ).inverse();
+  model.referenceH = referenceH;
+  model.logInputUnstained = inputUnstained.unaryExpr( CalcUnaryFunctionPointer( std::log ) );
+  model.logReferenceUnstained = referenceUnstained.unaryExpr( CalcUnaryFunctionPointer( std::log ) );
+  model.lowerbound = std::numeric_limits< PixelValueType >::min();
+  model.upperbound = std::numeric_limits< PixelValueType >::max();
+
+  // The rows of inputH are non-negative, so a pixel at least as bright
+  // as inputUnstained in every color has no stain, and its output is
+  // referenceUnstained, computed as the transform would compute it.
+  model.skipBackground = m_SkipBackground;
+  model.backgroundLowerbound = m_BackgroundThreshold * inputUnstained;
+  model.backgroundPixel = ( model.logReferenceUnstained.unaryExpr( CalcUnaryFunctionPointer( std::exp ) ).array() - CalcElementType( 1.0 ) )
+    .min( model.upperbound ).max( model.lowerbound ).matrix();
+}
+
+
+template< typename TImage, typename TCalcElement >
+typename StructurePreservingColorNormalizationFilter< TImage, TCalcElement >::SizeValueType
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::NMFsToImage( const ImageType *inputImage, const TransformModel &model, RegionIterator &outIt ) const
 {
-  // Read in corresponding part of the input region.
-  const SizeType size = outIt.GetRegion().GetSize();
-  const SizeValueType numberOfPixels = std::accumulate( size.begin(), size.end(), 1, std::multiplies< SizeValueType >() );
-  CalcMatrixType matrixV {numberOfPixels, m_NumberOfColors};
-  RegionConstIterator inIt {m_Input, m_Input->GetRequestedRegion()};
+  const CalcMatrixType &inputHTranspose {model.inputHTranspose};
+  const CalcMatrixType &inputHHTransposeInverse {model.inputHHTransposeInverse};
+  const CalcMatrixType &referenceH {model.referenceH};
+  const CalcRowVectorType &logInputUnstained {model.logInputUnstained};
+  const CalcRowVectorType &logReferenceUnstained {model.logReferenceUnstained};
+  const Eigen::Index numberOfStains {referenceH.rows()};
+
+  // The pixels are transformed in blocks of at most
+  // maxNumberOfRowsPerBlock, so that the scratch arrays are small and
+  // are reused for every block, regardless of the size of the region.
+  // The scratch arrays are column major, so that each color or stain
+  // of a block is contiguous and every step below is a vectorized
+  // operation on whole columns; in particular, std::log and std::exp
+  // are replaced by Eigen's vectorized versions, which are within
+  // MaximumVectorizedMathULPs of them.  When the region is a
+  // contiguous part of the buffers of both images, the pixels are
+  // read from and written to the buffers directly.  Otherwise, the
+  // input iterators walk the same region as the output iterator, so
+  // they visit matching pixels in lockstep.  Background pixels are
+  // marked as the block is read and are left out of its rows.
+  //
+  // Reading from and writing to the buffers deinterleaves and
+  // interleaves whole columns, each a strided view of the buffer, when
+  // every pixel of the block has a row of its own.  The reads stay a
+  // loop over pixels when the logarithms are looked up in a table,
+  // because that is a gather of one value at a time, and when
+  // SkipBackground is on, because the test for background is per
+  // pixel and leaves the rows out of step with the pixels.  For the
+  // same reason, the writes stay a loop over pixels when the block
+  // had background, when the exponentials are found by a search of a
+  // table, and when the pixels are visited with iterators.
+  const RegionType region {outIt.GetRegion()};
+  const SizeValueType numberOfPixels {region.GetNumberOfPixels()};
+  const Eigen::Index numberOfBlockRows {static_cast< Eigen::Index >( std::min( numberOfPixels, maxNumberOfRowsPerBlock ) )};
+  CalcColumnArrayType arrayV {numberOfBlockRows, m_NumberOfColors};
+  CalcColumnArrayType arrayProjected {numberOfBlockRows, numberOfStains};
+  CalcColumnArrayType arrayW {numberOfBlockRows, numberOfStains};
+  std::vector< bool > isBackground( numberOfBlockRows, false );
+  std::vector< PixelValueType > inputValues( m_NumberOfColors );
+  SizeValueType numberOfBackgroundPixels {0};
+  PixelType pixelValue = Self::PixelHelper< PixelType >::pixelInstance( m_NumberOfDimensions );
+  ImageType * const outputImage {const_cast< ImageType * >( outIt.GetImage() )};
+  const bool useBuffers {Self::IsContiguous( region, inputImage->GetBufferedRegion() ) && Self::IsContiguous( region, outputImage->GetBufferedRegion() )};
+  const PixelValueType * const inputBuffer {useBuffers ? Self::BufferPointer( inputImage, region.GetIndex() ) : nullptr};
+  PixelValueType * const outputBuffer {useBuffers ? Self::BufferPointer( outputImage, region.GetIndex() ) : nullptr};
+  RegionConstIterator inIt {inputImage, region};
+  RegionConstIterator passThroughIt {inputImage, region};
   outIt.GoToBegin();
-  inIt.GoToBegin();
-  for( SizeValueType pixelIndex {0}; !outIt.IsAtEnd(); ++outIt, ++inIt, ++pixelIndex )
+  using BufferColumnType = Eigen::Array< PixelValueType, Eigen::Dynamic, 1 >;
+  using BufferColumnMap = Eigen::Map< BufferColumnType, 0, Eigen::InnerStride<> >;
+  using BufferColumnConstMap = Eigen::Map< const BufferColumnType, 0, Eigen::InnerStride<> >;
+  const Eigen::InnerStride<> bufferStride {m_NumberOfDimensions};
+  // Copy the logarithms of the colors of one input pixel into the next
+  // row of our working array, unless it is background.
+  Eigen::Index blockRows {0};
+  const auto readPixel = [&] ( const PixelValueType *inputPixel, Eigen::Index pixelIndex )
+    {
+    isBackground[pixelIndex] = model.skipBackground;
+    for( Eigen::Index color = 0; color < m_NumberOfColors && isBackground[pixelIndex]; ++color )
+      {
+      isBackground[pixelIndex] = static_cast< CalcElementType >( inputPixel[color] ) >= model.backgroundLowerbound( color );
+      }
+    if( isBackground[pixelIndex] )
+      {
+      ++numberOfBackgroundPixels;
+      return;
+      }
+    for( Eigen::Index color = 0; color < m_NumberOfColors; ++color )
+      {
+      arrayV( blockRows, color ) = UseLogLookupTable
+        ? m_LogLookupTable[static_cast< SizeValueType >( inputPixel[color] )]
+        : static_cast< CalcElementType >( inputPixel[color] );
+      }
+    ++blockRows;
+    };
+  Eigen::Index blockPixels {0};
+  for( SizeValueType firstPixel {0}; firstPixel < numberOfPixels; firstPixel += blockPixels )
     {
-    // Find input index that matches this output index.
-    while ( inIt.GetIndex() != outIt.GetIndex() )
+    blockPixels = static_cast< Eigen::Index >( std::min( numberOfPixels - firstPixel, static_cast< SizeValueType >( numberOfBlockRows ) ) );
+    blockRows = 0;
+    if( useBuffers && !UseLogLookupTable && !model.skipBackground )
+      {
+      const PixelValueType * const blockBuffer {inputBuffer + firstPixel * m_NumberOfDimensions};
+      for( Eigen::Index color = 0; color < m_NumberOfColors; ++color )
+        {
+        arrayV.col( color ).head( blockPixels ) = BufferColumnConstMap {blockBuffer + color, blockPixels, bufferStride}.template cast< CalcElementType >();
+        }
+      std::fill( isBackground.begin(), isBackground.begin() + blockPixels, false );
+      blockRows = blockPixels;
+      }
+    else if( useBuffers )
+      {
+      const PixelValueType *inputPixel {inputBuffer + firstPixel * m_NumberOfDimensions};
+      for( Eigen::Index pixelIndex {0}; pixelIndex < blockPixels; ++pixelIndex, inputPixel += m_NumberOfDimensions )
+        {
+        readPixel( inputPixel, pixelIndex );
+        }
+      }
+    else
+      {
+      for( Eigen::Index pixelIndex {0}; pixelIndex < blockPixels; ++pixelIndex, ++inIt )
+        {
+        const PixelType inputPixel = inIt.Get();
+        for( Eigen::Index color = 0; color < m_NumberOfColors; ++color )
+          {
+          inputValues[color] = inputPixel[color];
+          }
+        readPixel( inputValues.data(), pixelIndex );
+        }
+      }
+    auto blockV = arrayV.topRows( blockRows );
+    auto blockProjected = arrayProjected.topRows( blockRows );
+    auto blockW = arrayW.topRows( blockRows );
+    if( !UseLogLookupTable )
+      {
+      blockV = blockV.log();
+      }
+
+    // Convert the block using the inputUnstained pixel.
+    for( Eigen::Index color = 0; color < m_NumberOfColors; ++color )
       {
-      ++inIt;
+      blockV.col( color ) = logInputUnstained( color ) - blockV.col( color );
       }
-    // Copy the input pixel into our working matrix.
-    PixelType pixelValue = inIt.Get();
+
+    // Switch from inputH to referenceH.
+    for( Eigen::Index stain = 0; stain < numberOfStains; ++stain )
+      {
+      blockProjected.col( stain ) = blockV.col( 0 ) * inputHTranspose( 0, stain );
+      for( Eigen::Index color = 1; color < m_NumberOfColors; ++color )
+        {
+        blockProjected.col( stain ) += blockV.col( color ) * inputHTranspose( color, stain );
+        }
+      blockProjected.col( stain ) -= lambda;
+      blockProjected.col( stain ) = ( blockProjected.col( stain ) > CalcElementType( 0.0 ) ).select( blockProjected.col( stain ), CalcElementType( 0.0 ) );
+      }
+    for( Eigen::Index stain = 0; stain < numberOfStains; ++stain )
+      {
+      blockW.col( stain ) = blockProjected.col( 0 ) * inputHHTransposeInverse( 0, stain );
+      for( Eigen::Index other = 1; other < numberOfStains; ++other )
+        {
+        blockW.col( stain ) += blockProjected.col( other ) * inputHHTransposeInverse( other, stain );
+        }
+      blockW.col( stain ) = ( blockW.col( stain ) > CalcElementType( 0.0 ) ).select( blockW.col( stain ), CalcElementType( 0.0 ) );
+      }
+
+    // Convert the block using the referenceUnstained pixel and
+    // exponentiation.
     for( Eigen::Index color = 0; color < m_NumberOfColors; ++color )
       {
-      matrixV( pixelIndex, color ) = static_cast< CalcElementType >( pixelValue[color] );
+      blockV.col( color ) = logReferenceUnstained( color ) - blockW.col( 0 ) * referenceH( 0, color );
+      for( Eigen::Index stain = 1; stain < numberOfStains; ++stain )
+        {
+        blockV.col( color ) -= blockW.col( stain ) * referenceH( stain, color );
+        }
+      }
+    if( !UseExpLookupTable )
+      {
+      blockV = ( blockV.exp() - CalcElementType( 1.0 ) ).min( model.upperbound ).max( model.lowerbound );
+      }
+
+    if( useBuffers && !UseExpLookupTable && blockRows == blockPixels )
+      {
+      const SizeValueType bufferOffset {firstPixel * m_NumberOfDimensions};
+      for( Eigen::Index color = 0; color < m_NumberOfColors; ++color )
+        {
+        BufferColumnMap {outputBuffer + bufferOffset + color, blockPixels, bufferStride} = blockV.col( color ).template cast< PixelValueType >();
+        }
+      if( outputBuffer != inputBuffer )
+        {
+        for( Eigen::Index dim = m_NumberOfColors; dim < m_NumberOfDimensions; ++dim )
+          {
+          BufferColumnMap {outputBuffer + bufferOffset + dim, blockPixels, bufferStride} = BufferColumnConstMap {inputBuffer + bufferOffset + dim, blockPixels, bufferStride};
+          }
+        }
+      continue;
+      }
+    Eigen::Index row {0};
+    for( Eigen::Index pixelIndex {0}; pixelIndex < blockPixels; ++pixelIndex )
+      {
+      if( isBackground[pixelIndex] )
+        {
+        for( Eigen::Index color = 0; color < m_NumberOfColors; ++color )
+          {
+          pixelValue[color] = model.backgroundPixel( color );
+          }
+        }
+      else
+        {
+        for( Eigen::Index color = 0; color < m_NumberOfColors; ++color )
+          {
+          if( UseExpLookupTable )
+            {
+            // A branch-free binary search for the number of table
+            // entries that are no larger than y; the table has 2^n - 1
+            // entries.
+            const CalcElementType y {blockV( row, color )};
+            SizeValueType numberNoLarger {0};
+            for( SizeValueType step {( m_ExpLookupTable.size() + 1 ) / 2}; step > 0; step /= 2 )
+              {
+              numberNoLarger += m_ExpLookupTable[numberNoLarger + step - 1] <= y ? step : 0;
+              }
+            pixelValue[color] = numberNoLarger;
+            }
+          else
+            {
+            pixelValue[color] = blockV( row, color );
+            }
+          }
+        ++row;
+        }
+      if( useBuffers )
+        {
+        const SizeValueType bufferOffset {( firstPixel + pixelIndex ) * m_NumberOfDimensions};
+        for( Eigen::Index color = 0; color < m_NumberOfColors; ++color )
+          {
+          outputBuffer[bufferOffset + color] = pixelValue[color];
+          }
+        for( Eigen::Index dim = m_NumberOfColors; dim < m_NumberOfDimensions; ++dim )
+          {
+          outputBuffer[bufferOffset + dim] = inputBuffer[bufferOffset + dim];
+          }
+        }
+      else
+        {
+        if( m_NumberOfColors < m_NumberOfDimensions )
+          {
+          const PixelType inputPixel = passThroughIt.Get();
+          for( Eigen::Index dim = m_NumberOfColors; dim < m_NumberOfDimensions; ++dim )
+            {
+            pixelValue[dim] = inputPixel[dim];
+            }
+          }
+        outIt.Set( pixelValue );
+        ++outIt;
+        ++passThroughIt;
+        }
       }
     }
+  return numberOfBackgroundPixels;
+}
+
+
+template< typename TImage, typename TCalcElement >
+void
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::BuildColorLookupTable( const TransformModel &model )
+{
+  const SizeValueType gridSize {m_ColorLookupTableSize};
+  const SizeValueType numberOfGridColors {gridSize * gridSize * gridSize};
+  if( m_ColorLookupTable != nullptr && m_ColorLookupTable->GetLargestPossibleRegion().GetNumberOfPixels() == numberOfGridColors
+    && m_ColorLookupTableModel.inputHTranspose == model.inputHTranspose
+    && m_ColorLookupTableModel.inputHHTransposeInverse == model.inputHHTransposeInverse
+    && m_ColorLookupTableModel.referenceH == model.referenceH
+    && m_ColorLookupTableModel.logInputUnstained == model.logInputUnstained
+    && m_ColorLookupTableModel.logReferenceUnstained == model.logReferenceUnstained )
+    {
+    return;
+    }
 
-  // Convert matrixV using the inputUnstained pixel and a call to
-  // logarithm.
-  CalcRowVectorType logInputUnstained = inputUnstained.unaryExpr( CalcUnaryFunctionPointer( std::log ) );
-  CalcRowVectorType logReferenceUnstained = referenceUnstained.unaryExpr( CalcUnaryFunctionPointer( std::log ) );
-  const CalcColVectorType firstOnes {CalcColVectorType::Constant( numberOfPixels, 1, 1.0 )};
-  matrixV = ( firstOnes * logInputUnstained ) - matrixV.unaryExpr( CalcUnaryFunctionPointer( std::log ) );
+  // The grid colors are evenly spaced, rounded color values from 0 to
+  // 255.  A color value lies in the last grid cell whose lower grid
+  // color is no larger than it, so each grid color is reproduced
+  // exactly with a weight of 0.
+  constexpr SizeValueType numberOfValues {256};
+  std::vector< PixelValueType > gridColors( gridSize );
+  for( SizeValueType node {0}; node < gridSize; ++node )
+    {
+    gridColors[node] = static_cast< PixelValueType >( ( node * ( numberOfValues - 1 ) + ( gridSize - 1 ) / 2 ) / ( gridSize - 1 ) );
+    }
+  m_ColorLookupTableCell.resize( numberOfValues );
+  m_ColorLookupTableWeight.resize( numberOfValues );
+  SizeValueType cell {0};
+  for( SizeValueType value {0}; value < numberOfValues; ++value )
+    {
+    while( cell + 2 < gridSize && gridColors[cell + 1] <= value )
+      {
+      ++cell;
+      }
+    m_ColorLookupTableCell[value] = cell;
+    m_ColorLookupTableWeight[value] = static_cast< CalcElementType >( value - gridColors[cell] ) / static_cast< CalcElementType >( gridColors[cell + 1] - gridColors[cell] );
+    }
 
-  // Switch from inputH to referenceH.
+  // The table is an image whose pixels are transformed as any image
+  // would be.  A work unit takes the grid colors for one value of the
+  // first color at a time, puts them in a small image of its own, and
+  // transforms them into the matching slab of the table.  The first
+  // color indexes the slowest varying dimension of the table, so that
+  // each slab is a contiguous block of its buffer, which NMFsToImage
+  // writes directly rather than through an iterator.  The pixels are
+  // in the same order in the buffer whatever the dimension of the
+  // image.
+  constexpr unsigned int slowDimension {ImageType::ImageDimension - 1};
+  RegionType tableRegion;
+  tableRegion.SetSize( 0, gridSize * gridSize );
+  for( unsigned int dim {1}; dim < ImageType::ImageDimension; ++dim )
+    {
+    tableRegion.SetSize( dim, 1 );
+    }
+  tableRegion.SetSize( slowDimension, tableRegion.GetSize( slowDimension ) * gridSize );
+  const SizeValueType slabSize {tableRegion.GetSize( slowDimension ) / gridSize};
+  m_ColorLookupTable = ImageType::New();
+  m_ColorLookupTable->SetRegions( tableRegion );
+  m_ColorLookupTable->SetNumberOfComponentsPerPixel( m_NumberOfDimensions );
+  m_ColorLookupTable->Allocate();
+  // Every grid color is transformed, background or not.
+  TransformModel gridModel {model};
+  gridModel.skipBackground = false;
+  const auto tabulateSlab = [this, &gridModel, &gridColors, gridSize, &tableRegion, slabSize] ( SizeValueType firstColor )
     {
-    const auto clip = [] ( const CalcElementType &x )
+    RegionType slabRegion {tableRegion};
+    slabRegion.SetIndex( slowDimension, static_cast< IndexValueType >( firstColor * slabSize ) );
+    slabRegion.SetSize( slowDimension, slabSize );
+    const ImagePointer gridImage {ImageType::New()};
+    gridImage->SetRegions( slabRegion );
+    gridImage->SetNumberOfComponentsPerPixel( m_NumberOfDimensions );
+    gridImage->Allocate();
+    PixelValueType *gridPixel {Self::BufferPointer( gridImage.GetPointer(), slabRegion.GetIndex() )};
+    for( SizeValueType secondColor {0}; secondColor < gridSize; ++secondColor )
       {
-      return std::max( CalcElementType( 0.0 ), x );
-      };
-    CalcMatrixType matrixW = ( ( ( matrixV * inputH.transpose() ).array() - lambda ).unaryExpr( clip ).matrix() * ( inputH * inputH.transpose() ).inverse() ).unaryExpr( clip );
-    matrixV = matrixW * referenceH;
+      for( SizeValueType thirdColor {0}; thirdColor < gridSize; ++thirdColor, gridPixel += m_NumberOfDimensions )
+        {
+        gridPixel[0] = gridColors[firstColor];
+        gridPixel[1] = gridColors[secondColor];
+        gridPixel[2] = gridColors[thirdColor];
+        for( Eigen::Index dim = m_NumberOfColors; dim < m_NumberOfDimensions; ++dim )
+          {
+          gridPixel[dim] = PixelValueType {};
+          }
+        }
+      }
+    RegionIterator outIt {m_ColorLookupTable, slabRegion};
+    this->NMFsToImage( gridImage, gridModel, outIt );
+    };
+  MultiThreaderBase * const multiThreader {this->GetMultiThreader()};
+  multiThreader->SetNumberOfWorkUnits( this->GetNumberOfWorkUnits() );
+  multiThreader->ParallelizeArray( 0, gridSize, tabulateSlab, nullptr );
+  m_ColorLookupTableModel = gridModel;
+}
+
+
+template< typename TImage, typename TCalcElement >
+void
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::ColorLookupTableToImage( const ImageType *inputImage, RegionIterator &outIt ) const
+{
+  // For pixel types without a color lookup table, this is compiled,
+  // with placeholder lengths, but not used.
+  constexpr int NumberOfDimensions {CanUseColorLookupTable ? static_cast< int >( Self::PixelHelper< PixelType >::NumberOfDimensions ) : 3};
+  constexpr int NumberOfColors {3};
+  const SizeValueType gridSize {static_cast< SizeValueType >( m_ColorLookupTableCell.back() + 2 )};
+  const PixelValueType * const table {Self::BufferPointer( m_ColorLookupTable.GetPointer(), m_ColorLookupTable->GetLargestPossibleRegion().GetIndex() )};
+  const SizeValueType * const cells {m_ColorLookupTableCell.data()};
+  const CalcElementType * const weights {m_ColorLookupTableWeight.data()};
+
+  // The offsets in the table from the grid color at the lower corner
+  // of a cell to the other corners, the first color varying slowest.
+  std::array< SizeValueType, 8 > cornerOffsets;
+  for( int corner = 0; corner < 8; ++corner )
+    {
+    cornerOffsets[corner] = ( ( ( corner >> 2 ) & 1 ) * gridSize * gridSize + ( ( corner >> 1 ) & 1 ) * gridSize + ( corner & 1 ) ) * NumberOfDimensions;
     }
 
-  // Convert matrixV using exponentiation and the referenceUnstained pixel.
-  matrixV = ( ( firstOnes * logReferenceUnstained ) - matrixV ).unaryExpr( CalcUnaryFunctionPointer( std::exp ) );
-  PixelType pixelValue = Self::PixelHelper< PixelType >::pixelInstance( m_NumberOfDimensions );
-  outIt.GoToBegin();
-  inIt.GoToBegin();
-  constexpr CalcElementType upperbound = std::numeric_limits< PixelValueType >::max();
-  constexpr CalcElementType lowerbound = std::numeric_limits< PixelValueType >::min();
-  for( SizeValueType pixelIndex {0}; !outIt.IsAtEnd(); ++outIt, ++pixelIndex )
+  const auto lookUpPixel = [table, gridSize] ( const PixelValueType *inputPixel, PixelValueType *pixelValue )
     {
-    while ( inIt.GetIndex() != outIt.GetIndex() )
+    const PixelValueType * const entry {table + ( ( static_cast< SizeValueType >( inputPixel[0] ) * gridSize + static_cast< SizeValueType >( inputPixel[1] ) ) * gridSize
+      + static_cast< SizeValueType >( inputPixel[2] ) ) * NumberOfDimensions};
+    for( int color = 0; color < NumberOfColors; ++color )
       {
-      ++inIt;
+      pixelValue[color] = entry[color];
       }
-    for( Eigen::Index color = 0; color < m_NumberOfColors; ++color )
+    for( int dim = NumberOfColors; dim < NumberOfDimensions; ++dim )
+      {
+      pixelValue[dim] = inputPixel[dim];
+      }
+    };
+  const auto interpolatePixel = [table, gridSize, cells, weights, &cornerOffsets] ( const PixelValueType *inputPixel, PixelValueType *pixelValue )
+    {
+    const SizeValueType value0 {static_cast< SizeValueType >( inputPixel[0] )};
+    const SizeValueType value1 {static_cast< SizeValueType >( inputPixel[1] )};
+    const SizeValueType value2 {static_cast< SizeValueType >( inputPixel[2] )};
+    const PixelValueType * const lowerEntry {table + ( ( cells[value0] * gridSize + cells[value1] ) * gridSize + cells[value2] ) * NumberOfDimensions};
+    const CalcElementType weight0 {weights[value0]};
+    const CalcElementType weight1 {weights[value1]};
+    const CalcElementType weight2 {weights[value2]};
+    CalcElementType cornerWeights[8];
+    for( int corner = 0; corner < 8; ++corner )
       {
-      pixelValue[color] = std::max( std::min( matrixV( pixelIndex, color ) - CalcElementType( 1.0 ), upperbound ), lowerbound );
+      cornerWeights[corner] = ( ( corner & 4 ) ? weight0 : CalcElementType( 1.0 ) - weight0 )
+        * ( ( corner & 2 ) ? weight1 : CalcElementType( 1.0 ) - weight1 )
+        * ( ( corner & 1 ) ? weight2 : CalcElementType( 1.0 ) - weight2 );
       }
-    const PixelType inputPixel = inIt.Get();
-    for( Eigen::Index dim = m_NumberOfColors; dim < m_NumberOfDimensions; ++dim )
+    for( int color = 0; color < NumberOfColors; ++color )
+      {
+      CalcElementType value {0.5};
+      for( int corner = 0; corner < 8; ++corner )
+        {
+        value += cornerWeights[corner] * lowerEntry[cornerOffsets[corner] + color];
+        }
+      pixelValue[color] = static_cast< PixelValueType >( value );
+      }
+    for( int dim = NumberOfColors; dim < NumberOfDimensions; ++dim )
       {
       pixelValue[dim] = inputPixel[dim];
       }
-    outIt.Set( pixelValue );
+    };
+
+  if( gridSize == m_ColorLookupTableCell.size() )
+    {
+    // The table has every color.
+    this->template ConvertPixels< NumberOfDimensions >( inputImage, outIt, lookUpPixel );
+    }
+  else
+    {
+    this->template ConvertPixels< NumberOfDimensions >( inputImage, outIt, interpolatePixel );
+    }
+}
+
+
+template< typename TImage, typename TCalcElement >
+template< int VNumberOfDimensions, typename TPixelConverter >
+void
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::ConvertPixels( const ImageType *inputImage, RegionIterator &outIt, const TPixelConverter &convertPixel ) const
+{
+  // When the region is a contiguous part of the buffers of both
+  // images, convert the pixels in place in the buffers.  Otherwise,
+  // go through the iterators and copies of the pixel values.
+  const RegionType region {outIt.GetRegion()};
+  const SizeValueType numberOfPixels {region.GetNumberOfPixels()};
+  ImageType * const outputImage {const_cast< ImageType * >( outIt.GetImage() )};
+  if( Self::IsContiguous( region, inputImage->GetBufferedRegion() ) && Self::IsContiguous( region, outputImage->GetBufferedRegion() ) )
+    {
+    const PixelValueType *inputPixel {Self::BufferPointer( inputImage, region.GetIndex() )};
+    PixelValueType *outputPixel {Self::BufferPointer( outputImage, region.GetIndex() )};
+    for( SizeValueType pixel {0}; pixel < numberOfPixels; ++pixel, inputPixel += VNumberOfDimensions, outputPixel += VNumberOfDimensions )
+      {
+      convertPixel( inputPixel, outputPixel );
+      }
+    }
+  else
+    {
+    PixelType pixelValue = Self::PixelHelper< PixelType >::pixelInstance( m_NumberOfDimensions );
+    PixelValueType inputValues[VNumberOfDimensions];
+    PixelValueType outputValues[VNumberOfDimensions];
+    RegionConstIterator inIt {inputImage, region};
+    for( outIt.GoToBegin(); !outIt.IsAtEnd(); ++outIt, ++inIt )
+      {
+      const PixelType inputPixel = inIt.Get();
+      for( int dim = 0; dim < VNumberOfDimensions; ++dim )
+        {
+        inputValues[dim] = inputPixel[dim];
+        }
+      convertPixel( inputValues, outputValues );
+      for( int dim = 0; dim < VNumberOfDimensions; ++dim )
+        {
+        pixelValue[dim] = outputValues[dim];
+        }
+      outIt.Set( pixelValue );
+      }
     }
 }
 
 #if STRUCTUREPRESERVINGCOLORNORMALIZATIONFILTER_STRICT_EIGEN3_ITERATORS
-template< typename TImage >
+template< typename TImage, typename TCalcElement >
 template< typename _Scalar, int _Rows, int _Cols, int _Options, int _MaxRows, int _MaxCols >
 _Scalar *
-StructurePreservingColorNormalizationFilter< TImage >
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
 ::begin( Eigen::Matrix< _Scalar, _Rows, _Cols, _Options, _MaxRows, _MaxCols > &matrix )
 {
   return matrix.data();
 }
 
-template< typename TImage >
+template< typename TImage, typename TCalcElement >
 template< typename _Scalar, int _Rows, int _Cols, int _Options, int _MaxRows, int _MaxCols >
 const _Scalar *
-StructurePreservingColorNormalizationFilter< TImage >
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
 ::cbegin( const Eigen::Matrix< _Scalar, _Rows, _Cols, _Options, _MaxRows, _MaxCols > &matrix )
 {
   return matrix.data();
 }
 
-template< typename TImage >
+template< typename TImage, typename TCalcElement >
 template< typename _Scalar, int _Rows, int _Cols, int _Options, int _MaxRows, int _MaxCols >
 _Scalar *
-StructurePreservingColorNormalizationFilter< TImage >
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
 ::end( Eigen::Matrix< _Scalar, _Rows, _Cols, _Options, _MaxRows, _MaxCols > &matrix )
 {
   itkAssertOrThrowMacro( std::distance( matrix.data(), &matrix( matrix.rows() - 1, matrix.cols() - 1 ) ) + 1 == matrix.size(), "Bad array stepping" )
   return matrix.data() + matrix.size();
 }
 
-template< typename TImage >
+template< typename TImage, typename TCalcElement >
 template< typename _Scalar, int _Rows, int _Cols, int _Options, int _MaxRows, int _MaxCols >
 const _Scalar *
-StructurePreservingColorNormalizationFilter< TImage >
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
 ::cend( const Eigen::Matrix< _Scalar, _Rows, _Cols, _Options, _MaxRows, _MaxCols > &matrix )
 {
   itkAssertOrThrowMacro( std::distance( matrix.data(), &matrix( matrix.rows() - 1, matrix.cols() - 1 ) ) + 1 == matrix.size(), "Bad array stepping" )
@@ -808,38 +2618,38 @@ StructurePreservingColorNormalizationFilter< TImage >
 }
 
 #else
-template< typename TImage >
+template< typename TImage, typename TCalcElement >
 template< typename TMatrix >
-typename StructurePreservingColorNormalizationFilter< TImage >::CalcElementType *
-StructurePreservingColorNormalizationFilter< TImage >
+typename StructurePreservingColorNormalizationFilter< TImage, TCalcElement >::CalcElementType *
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
 ::begin( TMatrix &matrix )
 {
   return matrix.data();
 }
 
-template< typename TImage >
+template< typename TImage, typename TCalcElement >
 template< typename TMatrix >
-const typename StructurePreservingColorNormalizationFilter< TImage >::CalcElementType *
-StructurePreservingColorNormalizationFilter< TImage >
+const typename StructurePreservingColorNormalizationFilter< TImage, TCalcElement >::CalcElementType *
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
 ::cbegin( const TMatrix &matrix )
 {
   return matrix.data();
 }
 
-template< typename TImage >
+template< typename TImage, typename TCalcElement >
 template< typename TMatrix >
-typename StructurePreservingColorNormalizationFilter< TImage >::CalcElementType *
-StructurePreservingColorNormalizationFilter< TImage >
+typename StructurePreservingColorNormalizationFilter< TImage, TCalcElement >::CalcElementType *
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
 ::end( TMatrix &matrix )
 {
   itkAssertOrThrowMacro( std::distance( matrix.data(), &matrix( matrix.rows() - 1, matrix.cols() - 1 ) ) + 1 == matrix.size(), "Bad array stepping" )
   return matrix.data() + matrix.size();
 }
 
-template< typename TImage >
+template< typename TImage, typename TCalcElement >
 template< typename TMatrix >
-const typename StructurePreservingColorNormalizationFilter< TImage >::CalcElementType *
-StructurePreservingColorNormalizationFilter< TImage >
+const typename StructurePreservingColorNormalizationFilter< TImage, TCalcElement >::CalcElementType *
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
 ::cend( const TMatrix &matrix )
 {
   itkAssertOrThrowMacro( std::distance( matrix.data(), &matrix( matrix.rows() - 1, matrix.cols() - 1 ) ) + 1 == matrix.size(), "Bad array stepping" )
@@ -851,56 +2661,61 @@ StructurePreservingColorNormalizationFilter< TImage >
 // reference, and some compilers will thus demand that they be defined
 // too.  We do that here.
 
-template< typename TImage >
-constexpr typename StructurePreservingColorNormalizationFilter< TImage >::SizeValueType
-StructurePreservingColorNormalizationFilter< TImage >
+template< typename TImage, typename TCalcElement >
+constexpr typename StructurePreservingColorNormalizationFilter< TImage, TCalcElement >::SizeValueType
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
 ::NumberOfStains;
 
-template< typename TImage >
-constexpr typename StructurePreservingColorNormalizationFilter< TImage >::SizeValueType
-StructurePreservingColorNormalizationFilter< TImage >
-::maxNumberOfIterations;
-
-template< typename TImage >
-constexpr typename StructurePreservingColorNormalizationFilter< TImage >::SizeValueType
-StructurePreservingColorNormalizationFilter< TImage >
-::maxNumberOfRows;
-
-template< typename TImage >
-constexpr typename StructurePreservingColorNormalizationFilter< TImage >::CalcElementType
-StructurePreservingColorNormalizationFilter< TImage >
-::SecondPassDistinguishersThreshold;
-
-template< typename TImage >
-constexpr typename StructurePreservingColorNormalizationFilter< TImage >::CalcElementType
-StructurePreservingColorNormalizationFilter< TImage >
-::BrightPercentileLevel;
-
-template< typename TImage >
-constexpr typename StructurePreservingColorNormalizationFilter< TImage >::CalcElementType
-StructurePreservingColorNormalizationFilter< TImage >
-::BrightPercentageLevel;
-
-template< typename TImage >
-constexpr typename StructurePreservingColorNormalizationFilter< TImage >::CalcElementType
-StructurePreservingColorNormalizationFilter< TImage >
-::VeryDarkPercentileLevel;
-
-template< typename TImage >
-constexpr typename StructurePreservingColorNormalizationFilter< TImage >::CalcElementType
-StructurePreservingColorNormalizationFilter< TImage >
-::epsilon0;
-
-template< typename TImage >
-constexpr typename StructurePreservingColorNormalizationFilter< TImage >::CalcElementType
-StructurePreservingColorNormalizationFilter< TImage >
+template< typename TImage, typename TCalcElement >
+constexpr typename StructurePreservingColorNormalizationFilter< TImage, TCalcElement >::SizeValueType
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::maxNumberOfRowsPerBlock;
+
+template< typename TImage, typename TCalcElement >
+constexpr typename StructurePreservingColorNormalizationFilter< TImage, TCalcElement >::SizeValueType
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::numberOfPixelsPerStratum;
+
+template< typename TImage, typename TCalcElement >
+constexpr typename StructurePreservingColorNormalizationFilter< TImage, TCalcElement >::SizeValueType
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::numberOfSampleRowsPerBlock;
+
+template< typename TImage, typename TCalcElement >
+constexpr typename StructurePreservingColorNormalizationFilter< TImage, TCalcElement >::CalcElementType
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
 ::epsilon2;
 
-template< typename TImage >
-constexpr typename StructurePreservingColorNormalizationFilter< TImage >::CalcElementType
-StructurePreservingColorNormalizationFilter< TImage >
+template< typename TImage, typename TCalcElement >
+constexpr typename StructurePreservingColorNormalizationFilter< TImage, TCalcElement >::CalcElementType
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
 ::lambda;
 
+template< typename TImage, typename TCalcElement >
+constexpr bool
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::UseLogLookupTable;
+
+template< typename TImage, typename TCalcElement >
+constexpr typename StructurePreservingColorNormalizationFilter< TImage, TCalcElement >::SizeValueType
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::EigenVectorBytes;
+
+template< typename TImage, typename TCalcElement >
+constexpr bool
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::UseExpLookupTable;
+
+template< typename TImage, typename TCalcElement >
+constexpr bool
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::CanUseColorLookupTable;
+
+template< typename TImage, typename TCalcElement >
+constexpr int
+StructurePreservingColorNormalizationFilter< TImage, TCalcElement >
+::MaximumVectorizedMathULPs;
+
 } // end namespace itk
 
 #endif // itkStructurePreservingColorNormalizationFilter_hxx
@@ -0,0 +1,271 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+#ifndef itkStructurePreservingColorNormalizationModelCache_h
+#define itkStructurePreservingColorNormalizationModelCache_h
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include "itkStructurePreservingColorNormalizationStainModel.h"
+
+namespace itk
+{
+
+/** \class StructurePreservingColorNormalizationModelCache
+ *
+ * \brief A process-wide cache of the reference stain models that
+ * StructurePreservingColorNormalizationFilter instances estimate with
+ * UseSharedReferenceCache on.
+ *
+ * Each model is keyed by a hash of what its estimate depends upon,
+ * so that filters that are given the same reference image, each in
+ * its own thread, estimate its stain model once among them.  While
+ * one filter estimates a model, the others that need it wait for it.
+ * The cache holds at most MaximumNumberOfModels models, which
+ * defaults to 8, and when it is full it discards the one that was
+ * least recently used.  A model that is still being estimated is
+ * never discarded.
+ *
+ * All methods are static and safe to call from any thread.
+ *
+ * \ingroup StructurePreservingColorNormalization
+ *
+ */
+class StructurePreservingColorNormalizationModelCache
+{
+public:
+  using Self = StructurePreservingColorNormalizationModelCache;
+  using StainModelType = StructurePreservingColorNormalizationStainModel;
+  using KeyType = std::uint64_t;
+
+  /** Builds a key as the 64-bit FNV-1a hash of the bytes that are
+   * appended to it. */
+  class KeyBuilder
+  {
+  public:
+    void
+    Append( const void *data, std::size_t numberOfBytes )
+    {
+      const unsigned char *byte {static_cast< const unsigned char * >( data )};
+      for( const unsigned char * const end {byte + numberOfBytes}; byte != end; ++byte )
+        {
+        m_Key = ( m_Key ^ *byte ) * KeyType {1099511628211u};
+        }
+    }
+
+    template< typename TValue >
+    void
+    Append( const TValue &value )
+    {
+      this->Append( &value, sizeof( TValue ) );
+    }
+
+    KeyType
+    GetKey() const
+    {
+      return m_Key;
+    }
+
+  private:
+    KeyType m_Key {14695981039346656037u};
+  };
+
+  /** Return the model cached for key, setting found to true, or else
+   * call estimate() for it, setting found to false.  An empty model
+   * from estimate() means that the estimate failed; it is returned
+   * but not cached.  If estimate() throws, nothing is cached and the
+   * exception is passed on. */
+  template< typename TEstimate >
+  static StainModelType
+  FindOrEstimate( KeyType key, TEstimate estimate, bool &found )
+  {
+    State &state {Self::GetState()};
+    while( true )
+      {
+      std::shared_future< StainModelType > pending;
+      std::promise< StainModelType > promise;
+        {
+        std::lock_guard< std::mutex > lock {state.mutex};
+        const auto entry = state.entries.find( key );
+        if( entry != state.entries.end() )
+          {
+          // It is now the most recently used.
+          state.order.splice( state.order.begin(), state.order, entry->second.position );
+          pending = entry->second.model;
+          }
+        else
+          {
+          state.order.push_front( key );
+          state.entries.insert( std::make_pair( key, Entry {promise.get_future().share(), state.order.begin()} ) );
+          Self::Evict( state );
+          }
+        }
+
+      if( pending.valid() )
+        {
+        try
+          {
+          const StainModelType model {pending.get()};
+          found = true;
+          return model;
+          }
+        catch( ... )
+          {
+          // The estimate was abandoned, so try again.
+          continue;
+          }
+        }
+
+      StainModelType model;
+      try
+        {
+        model = estimate();
+        }
+      catch( ... )
+        {
+        Self::Erase( state, key );
+        promise.set_exception( std::current_exception() );
+        throw;
+        }
+      if( model.IsEmpty() )
+        {
+        Self::Erase( state, key );
+        }
+      promise.set_value( model );
+      found = false;
+      return model;
+      }
+  }
+
+  /** The most models that the cache holds, at least 1. */
+  static void
+  SetMaximumNumberOfModels( std::size_t maximumNumberOfModels )
+  {
+    State &state {Self::GetState()};
+    std::lock_guard< std::mutex > lock {state.mutex};
+    state.maximumNumberOfModels = std::max( maximumNumberOfModels, std::size_t {1} );
+    Self::Evict( state );
+  }
+
+  static std::size_t
+  GetMaximumNumberOfModels()
+  {
+    State &state {Self::GetState()};
+    std::lock_guard< std::mutex > lock {state.mutex};
+    return state.maximumNumberOfModels;
+  }
+
+  /** The number of models cached or being estimated. */
+  static std::size_t
+  GetNumberOfModels()
+  {
+    State &state {Self::GetState()};
+    std::lock_guard< std::mutex > lock {state.mutex};
+    return state.entries.size();
+  }
+
+  /** Discard every model that is not still being estimated. */
+  static void
+  Clear()
+  {
+    State &state {Self::GetState()};
+    std::lock_guard< std::mutex > lock {state.mutex};
+    for( auto position = state.order.begin(); position != state.order.end(); )
+      {
+      const auto entry = state.entries.find( *position );
+      if( Self::IsReady( entry->second ) )
+        {
+        state.entries.erase( entry );
+        position = state.order.erase( position );
+        }
+      else
+        {
+        ++position;
+        }
+      }
+  }
+
+private:
+  struct Entry
+    {
+    std::shared_future< StainModelType > model;
+    std::list< KeyType >::iterator position;
+    };
+
+  // The keys are in order from most to least recently used.
+  struct State
+    {
+    std::mutex mutex;
+    std::list< KeyType > order;
+    std::unordered_map< KeyType, Entry > entries;
+    std::size_t maximumNumberOfModels {8};
+    };
+
+  static State &
+  GetState()
+  {
+    static State state;
+    return state;
+  }
+
+  static bool
+  IsReady( const Entry &entry )
+  {
+    return entry.model.wait_for( std::chrono::seconds( 0 ) ) == std::future_status::ready;
+  }
+
+  // Discard the least recently used models that are not still being
+  // estimated until there are few enough.  The caller holds the lock.
+  static void
+  Evict( State &state )
+  {
+    for( auto position = state.order.end(); state.entries.size() > state.maximumNumberOfModels && position != state.order.begin(); )
+      {
+      --position;
+      const auto entry = state.entries.find( *position );
+      if( Self::IsReady( entry->second ) )
+        {
+        state.entries.erase( entry );
+        position = state.order.erase( position );
+        }
+      }
+  }
+
+  static void
+  Erase( State &state, KeyType key )
+  {
+    std::lock_guard< std::mutex > lock {state.mutex};
+    const auto entry = state.entries.find( key );
+    if( entry != state.entries.end() )
+      {
+      state.order.erase( entry->second.position );
+      state.entries.erase( entry );
+      }
+  }
+};
+
+} // namespace itk
+
+#endif // itkStructurePreservingColorNormalizationModelCache_h
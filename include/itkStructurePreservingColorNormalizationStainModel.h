@@ -0,0 +1,363 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+#ifndef itkStructurePreservingColorNormalizationStainModel_h
+#define itkStructurePreservingColorNormalizationStainModel_h
+
+#include <cctype>
+#include <fstream>
+#include <iterator>
+#include <locale>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "itkMacro.h"
+#include "itkeigen/Eigen/Core"
+
+namespace itk
+{
+
+/** \class StructurePreservingColorNormalizationStainModel
+ *
+ * \brief The stain estimate that
+ * StructurePreservingColorNormalizationFilter computes for an image.
+ *
+ * The model consists of the matrix H, which has one row per stain
+ * giving the optical density of that stain in each color, and the
+ * unstained pixel, which is the color of a pixel without stain.  A
+ * model can be fetched from one filter after an update, written to
+ * and read from a small JSON document, and supplied to other filters
+ * in place of a reference image, so that the reference image need not
+ * be read again.
+ *
+ * The JSON document has the form
+ * { "unstainedPixel": [ ... ], "matrixH": [ [ ... ], [ ... ] ] }
+ * and its numbers are written with enough digits that reading them
+ * back reproduces the model exactly.
+ *
+ * \ingroup StructurePreservingColorNormalization
+ *
+ */
+class StructurePreservingColorNormalizationStainModel
+{
+public:
+  using CalcElementType = double;
+  using CalcMatrixType = Eigen::Matrix< CalcElementType, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor >;
+  using CalcRowVectorType = Eigen::Matrix< CalcElementType, 1, Eigen::Dynamic >;
+
+  /** An empty model, with no stains and no colors. */
+  StructurePreservingColorNormalizationStainModel() = default;
+
+  StructurePreservingColorNormalizationStainModel( const CalcMatrixType &matrixH, const CalcRowVectorType &unstainedPixel )
+    : m_MatrixH( matrixH ), m_UnstainedPixel( unstainedPixel )
+  {
+    itkAssertOrThrowMacro( matrixH.cols() == unstainedPixel.cols(), "The stain matrix and the unstained pixel need the same number of colors" );
+  }
+
+  const CalcMatrixType &
+  GetMatrixH() const
+  {
+    return m_MatrixH;
+  }
+
+  const CalcRowVectorType &
+  GetUnstainedPixel() const
+  {
+    return m_UnstainedPixel;
+  }
+
+  Eigen::Index
+  GetNumberOfStains() const
+  {
+    return m_MatrixH.rows();
+  }
+
+  Eigen::Index
+  GetNumberOfColors() const
+  {
+    return m_UnstainedPixel.cols();
+  }
+
+  bool
+  IsEmpty() const
+  {
+    return m_UnstainedPixel.size() == 0;
+  }
+
+  bool
+  operator==( const StructurePreservingColorNormalizationStainModel &other ) const
+  {
+    return m_MatrixH.rows() == other.m_MatrixH.rows() && m_MatrixH.cols() == other.m_MatrixH.cols()
+      && m_UnstainedPixel.cols() == other.m_UnstainedPixel.cols() && m_MatrixH == other.m_MatrixH && m_UnstainedPixel == other.m_UnstainedPixel;
+  }
+
+  bool
+  operator!=( const StructurePreservingColorNormalizationStainModel &other ) const
+  {
+    return !( *this == other );
+  }
+
+  /** Write the model as a JSON document.  JSON has no representation
+   * for values that are not finite, so a model with one is not
+   * written. */
+  void
+  WriteJSON( std::ostream &os ) const
+  {
+    if( !m_UnstainedPixel.allFinite() || !m_MatrixH.allFinite() )
+      {
+      itkGenericExceptionMacro( "A stain model with a value that is not finite cannot be written as JSON" );
+      }
+    std::ostringstream out;
+    out.imbue( std::locale::classic() );
+    out.precision( std::numeric_limits< CalcElementType >::max_digits10 );
+    out << "{\n  \"unstainedPixel\": [";
+    for( Eigen::Index color {0}; color < m_UnstainedPixel.cols(); ++color )
+      {
+      out << ( color == 0 ? "" : ", " ) << m_UnstainedPixel( color );
+      }
+    out << "],\n  \"matrixH\": [";
+    for( Eigen::Index stain {0}; stain < m_MatrixH.rows(); ++stain )
+      {
+      out << ( stain == 0 ? "\n    [" : ",\n    [" );
+      for( Eigen::Index color {0}; color < m_MatrixH.cols(); ++color )
+        {
+        out << ( color == 0 ? "" : ", " ) << m_MatrixH( stain, color );
+        }
+      out << "]";
+      }
+    out << "\n  ]\n}\n";
+    os << out.str();
+  }
+
+  void
+  WriteJSON( const std::string &fileName ) const
+  {
+    std::ofstream os {fileName};
+    if( !os )
+      {
+      itkGenericExceptionMacro( "Could not open " << fileName << " to write a stain model" );
+      }
+    this->WriteJSON( os );
+    if( !os )
+      {
+      itkGenericExceptionMacro( "Could not write a stain model to " << fileName );
+      }
+  }
+
+  /** Replace the model with the one in a JSON document, as written
+   * by WriteJSON. */
+  void
+  ReadJSON( std::istream &is )
+  {
+    const std::string text {std::istreambuf_iterator< char >( is ), std::istreambuf_iterator< char >()};
+    std::string::size_type position {0};
+    std::vector< CalcElementType > unstainedPixel;
+    std::vector< std::vector< CalcElementType > > matrixH;
+    bool haveUnstainedPixel {false};
+    bool haveMatrixH {false};
+
+    Expect( text, position, '{' );
+    do
+      {
+      const std::string key {ParseString( text, position )};
+      Expect( text, position, ':' );
+      if( key == "unstainedPixel" )
+        {
+        unstainedPixel = ParseNumbers( text, position );
+        haveUnstainedPixel = true;
+        }
+      else if( key == "matrixH" )
+        {
+        matrixH.clear();
+        Expect( text, position, '[' );
+        if( !Accept( text, position, ']' ) )
+          {
+          do
+            {
+            matrixH.push_back( ParseNumbers( text, position ) );
+            }
+          while( Accept( text, position, ',' ) );
+          Expect( text, position, ']' );
+          }
+        haveMatrixH = true;
+        }
+      else
+        {
+        itkGenericExceptionMacro( "Unknown key \"" << key << "\" in stain model" );
+        }
+      }
+    while( Accept( text, position, ',' ) );
+    Expect( text, position, '}' );
+
+    if( !haveUnstainedPixel || !haveMatrixH )
+      {
+      itkGenericExceptionMacro( "A stain model needs both \"unstainedPixel\" and \"matrixH\"" );
+      }
+    if( unstainedPixel.empty() )
+      {
+      itkGenericExceptionMacro( "The \"unstainedPixel\" of a stain model needs at least one color" );
+      }
+    const Eigen::Index numberOfColors {static_cast< Eigen::Index >( unstainedPixel.size() )};
+    CalcMatrixType newMatrixH {static_cast< Eigen::Index >( matrixH.size() ), numberOfColors};
+    for( Eigen::Index stain {0}; stain < newMatrixH.rows(); ++stain )
+      {
+      if( static_cast< Eigen::Index >( matrixH[stain].size() ) != numberOfColors )
+        {
+        itkGenericExceptionMacro( "Each row of \"matrixH\" needs one number per color of \"unstainedPixel\"" );
+        }
+      for( Eigen::Index color {0}; color < numberOfColors; ++color )
+        {
+        newMatrixH( stain, color ) = matrixH[stain][color];
+        }
+      }
+    m_MatrixH = newMatrixH;
+    m_UnstainedPixel = CalcRowVectorType {1, numberOfColors};
+    for( Eigen::Index color {0}; color < numberOfColors; ++color )
+      {
+      m_UnstainedPixel( color ) = unstainedPixel[color];
+      }
+  }
+
+  void
+  ReadJSON( const std::string &fileName )
+  {
+    std::ifstream is {fileName};
+    if( !is )
+      {
+      itkGenericExceptionMacro( "Could not open " << fileName << " to read a stain model" );
+      }
+    this->ReadJSON( is );
+  }
+
+private:
+  static void
+  SkipWhitespace( const std::string &text, std::string::size_type &position )
+  {
+    while( position < text.size() && std::isspace( static_cast< unsigned char >( text[position] ) ) )
+      {
+      ++position;
+      }
+  }
+
+  static bool
+  Accept( const std::string &text, std::string::size_type &position, char expected )
+  {
+    SkipWhitespace( text, position );
+    if( position < text.size() && text[position] == expected )
+      {
+      ++position;
+      return true;
+      }
+    return false;
+  }
+
+  static void
+  Expect( const std::string &text, std::string::size_type &position, char expected )
+  {
+    if( !Accept( text, position, expected ) )
+      {
+      itkGenericExceptionMacro( "Expected '" << expected << "' at character " << position << " of stain model" );
+      }
+  }
+
+  static std::string
+  ParseString( const std::string &text, std::string::size_type &position )
+  {
+    Expect( text, position, '"' );
+    const std::string::size_type end {text.find( '"', position )};
+    if( end == std::string::npos )
+      {
+      itkGenericExceptionMacro( "Unterminated string in stain model" );
+      }
+    const std::string result {text.substr( position, end - position )};
+    position = end + 1;
+    return result;
+  }
+
+  // Skip a sequence of decimal digits, returning whether there was at
+  // least one.
+  static bool
+  SkipDigits( const std::string &text, std::string::size_type &position )
+  {
+    const std::string::size_type start {position};
+    while( position < text.size() && std::isdigit( static_cast< unsigned char >( text[position] ) ) )
+      {
+      ++position;
+      }
+    return position > start;
+  }
+
+  static std::vector< CalcElementType >
+  ParseNumbers( const std::string &text, std::string::size_type &position )
+  {
+    std::vector< CalcElementType > result;
+    Expect( text, position, '[' );
+    if( Accept( text, position, ']' ) )
+      {
+      return result;
+      }
+    do
+      {
+      // Only a JSON number is accepted: an optional minus sign,
+      // digits, an optional fraction, and an optional exponent.  It is
+      // converted in the classic locale, whatever the global locale.
+      SkipWhitespace( text, position );
+      const std::string::size_type start {position};
+      Accept( text, position, '-' );
+      bool isNumber {SkipDigits( text, position )};
+      if( isNumber && position < text.size() && text[position] == '.' )
+        {
+        ++position;
+        isNumber = SkipDigits( text, position );
+        }
+      if( isNumber && position < text.size() && ( text[position] == 'e' || text[position] == 'E' ) )
+        {
+        ++position;
+        if( position < text.size() && ( text[position] == '+' || text[position] == '-' ) )
+          {
+          ++position;
+          }
+        isNumber = SkipDigits( text, position );
+        }
+      CalcElementType value {0};
+      if( isNumber )
+        {
+        std::istringstream in {text.substr( start, position - start )};
+        in.imbue( std::locale::classic() );
+        in >> value;
+        isNumber = !in.fail();
+        }
+      if( !isNumber )
+        {
+        itkGenericExceptionMacro( "Expected a number at character " << start << " of stain model" );
+        }
+      result.push_back( value );
+      }
+    while( Accept( text, position, ',' ) );
+    Expect( text, position, ']' );
+    return result;
+  }
+
+  CalcMatrixType m_MatrixH;
+  CalcRowVectorType m_UnstainedPixel;
+};
+
+} // namespace itk
+
+#endif // itkStructurePreservingColorNormalizationStainModel_h
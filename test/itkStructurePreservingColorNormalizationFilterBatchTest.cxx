@@ -0,0 +1,175 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+#include "itkStructurePreservingColorNormalizationFilter.h"
+
+#include "itkImageDuplicator.h"
+#include "itkImageFileReader.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkTestingMacros.h"
+
+#include <algorithm>
+
+int itkStructurePreservingColorNormalizationFilterBatchTest( int argc, char * argv[] )
+{
+  if( argc < 3 )
+  {
+    std::cerr << "Missing parameters." << std::endl;
+    std::cerr << "Usage: " << itkNameOfTestExecutableMacro( argv );
+    std::cerr << " input0Image";
+    std::cerr << " input1Image";
+    std::cerr << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  const char * const input0ImageFileName = argv[1];
+  const char * const input1ImageFileName = argv[2];
+
+  constexpr unsigned int Dimension = 2;
+  using PixelType = itk::RGBPixel< unsigned char >;
+  using ImageType = itk::Image< PixelType, Dimension >; // IRGBUC2
+  using FilterType = itk::StructurePreservingColorNormalizationFilter< ImageType >;
+
+  using ReaderType = itk::ImageFileReader< ImageType >;
+  ReaderType::Pointer reader0 = ReaderType::New();
+  reader0->SetFileName( input0ImageFileName );
+  TRY_EXPECT_NO_EXCEPTION( reader0->Update() );
+  ReaderType::Pointer reader1 = ReaderType::New();
+  reader1->SetFileName( input1ImageFileName );
+  TRY_EXPECT_NO_EXCEPTION( reader1->Update() );
+
+  // Normalize both images, as a batch, to the second.
+  FilterType::Pointer batchFilter = FilterType::New();
+  batchFilter->SetInput( 1, reader1->GetOutput() );
+  const std::vector< ImageType::Pointer > batch {reader0->GetOutput(), reader1->GetOutput()};
+  std::vector< ImageType::Pointer > batchOutputs;
+  const itk::ThreadIdType numberOfWorkUnits {batchFilter->GetMultiThreader()->GetNumberOfWorkUnits()};
+  TRY_EXPECT_NO_EXCEPTION( batchOutputs = batchFilter->NormalizeBatch( batch ) );
+  TEST_EXPECT_EQUAL( batchOutputs.size(), batch.size() );
+  TEST_EXPECT_EQUAL( batchFilter->GetMultiThreader()->GetNumberOfWorkUnits(), numberOfWorkUnits );
+
+  // Each output is what the pipeline produces for its image alone.
+  for( std::vector< ImageType::Pointer >::size_type image {0}; image < batch.size(); ++image )
+    {
+    FilterType::Pointer filter = FilterType::New();
+    filter->SetInput( 0, batch[image] );
+    filter->SetInput( 1, reader1->GetOutput() );
+    TRY_EXPECT_NO_EXCEPTION( filter->Update() );
+
+    TEST_EXPECT_TRUE( batchOutputs[image]->GetLargestPossibleRegion() == filter->GetOutput()->GetLargestPossibleRegion() );
+    itk::ImageRegionConstIterator< ImageType > expectedIt {filter->GetOutput(), filter->GetOutput()->GetLargestPossibleRegion()};
+    itk::ImageRegionConstIterator< ImageType > batchIt {batchOutputs[image], batchOutputs[image]->GetLargestPossibleRegion()};
+    for( ; !expectedIt.IsAtEnd(); ++expectedIt, ++batchIt )
+      {
+      if( expectedIt.Get() != batchIt.Get() )
+        {
+        std::cerr << "Batch output for image " << image << " differs from filter output at " << batchIt.GetIndex() << std::endl;
+        return EXIT_FAILURE;
+        }
+      }
+    }
+
+  // In place, a batch image is overwritten with, and returned as, its
+  // normalized pixels.
+  using DuplicatorType = itk::ImageDuplicator< ImageType >;
+  DuplicatorType::Pointer duplicator = DuplicatorType::New();
+  duplicator->SetInputImage( reader0->GetOutput() );
+  TRY_EXPECT_NO_EXCEPTION( duplicator->Update() );
+  const std::vector< ImageType::Pointer > inPlaceBatch {duplicator->GetOutput()};
+  FilterType::Pointer inPlaceBatchFilter = FilterType::New();
+  TEST_EXPECT_TRUE( !inPlaceBatchFilter->GetInPlace() );
+  inPlaceBatchFilter->InPlaceOn();
+  inPlaceBatchFilter->SetInput( 1, reader1->GetOutput() );
+  std::vector< ImageType::Pointer > inPlaceOutputs;
+  TRY_EXPECT_NO_EXCEPTION( inPlaceOutputs = inPlaceBatchFilter->NormalizeBatch( inPlaceBatch ) );
+  TEST_EXPECT_TRUE( inPlaceOutputs.front() == inPlaceBatch.front() );
+
+  // In a pipeline, the output takes over the buffer of the image to be
+  // normalized.
+  DuplicatorType::Pointer pipelineDuplicator = DuplicatorType::New();
+  pipelineDuplicator->SetInputImage( reader0->GetOutput() );
+  TRY_EXPECT_NO_EXCEPTION( pipelineDuplicator->Update() );
+  const ImageType::Pointer inPlaceInput {pipelineDuplicator->GetOutput()};
+  FilterType::Pointer inPlaceFilter = FilterType::New();
+  inPlaceFilter->InPlaceOn();
+  const PixelType * const inPlaceBuffer {inPlaceInput->GetBufferPointer()};
+  inPlaceFilter->SetInput( 0, inPlaceInput );
+  inPlaceFilter->SetInput( 1, reader1->GetOutput() );
+  TRY_EXPECT_NO_EXCEPTION( inPlaceFilter->Update() );
+  TEST_EXPECT_TRUE( inPlaceFilter->GetOutput()->GetBufferPointer() == inPlaceBuffer );
+
+  for( const ImageType * const inPlaceOutput : {inPlaceOutputs.front().GetPointer(), inPlaceFilter->GetOutput()} )
+    {
+    itk::ImageRegionConstIterator< ImageType > expectedIt {batchOutputs.front(), batchOutputs.front()->GetLargestPossibleRegion()};
+    itk::ImageRegionConstIterator< ImageType > inPlaceIt {inPlaceOutput, inPlaceOutput->GetLargestPossibleRegion()};
+    for( ; !expectedIt.IsAtEnd(); ++expectedIt, ++inPlaceIt )
+      {
+      if( expectedIt.Get() != inPlaceIt.Get() )
+        {
+        std::cerr << "In place output differs from batch output at " << inPlaceIt.GetIndex() << std::endl;
+        return EXIT_FAILURE;
+        }
+      }
+    }
+
+  // Outputs that the caller allocates are written where they are.
+  std::vector< ImageType::Pointer > callerOutputs;
+  for( const ImageType::Pointer &image : batch )
+    {
+    ImageType::Pointer callerOutput = ImageType::New();
+    callerOutput->CopyInformation( image );
+    callerOutput->SetRegions( image->GetLargestPossibleRegion() );
+    callerOutput->Allocate();
+    callerOutputs.push_back( callerOutput );
+    }
+  const PixelType * const callerBuffer {callerOutputs.front()->GetBufferPointer()};
+  TRY_EXPECT_NO_EXCEPTION( batchFilter->NormalizeBatch( batch, callerOutputs ) );
+  TEST_EXPECT_TRUE( callerOutputs.front()->GetBufferPointer() == callerBuffer );
+  TRY_EXPECT_EXCEPTION( batchFilter->NormalizeBatch( batch, {callerOutputs.front()} ) );
+
+  // Tiles stacked along the slowest varying dimension are each
+  // normalized as an image of a batch.  Here the stack is the image
+  // to be normalized, twice.
+  const ImageType::RegionType tileRegion {reader0->GetOutput()->GetLargestPossibleRegion()};
+  ImageType::RegionType stackRegion {tileRegion};
+  stackRegion.SetSize( Dimension - 1, 2 * tileRegion.GetSize( Dimension - 1 ) );
+  ImageType::Pointer inputTiles = ImageType::New();
+  inputTiles->SetRegions( stackRegion );
+  inputTiles->Allocate();
+  ImageType::Pointer outputTiles = ImageType::New();
+  outputTiles->SetRegions( stackRegion );
+  outputTiles->Allocate();
+  const itk::SizeValueType tilePixels {tileRegion.GetNumberOfPixels()};
+  std::copy( reader0->GetOutput()->GetBufferPointer(), reader0->GetOutput()->GetBufferPointer() + tilePixels, inputTiles->GetBufferPointer() );
+  std::copy( reader0->GetOutput()->GetBufferPointer(), reader0->GetOutput()->GetBufferPointer() + tilePixels, inputTiles->GetBufferPointer() + tilePixels );
+  TRY_EXPECT_NO_EXCEPTION( batchFilter->NormalizeTiles( inputTiles, outputTiles, 2 ) );
+  TRY_EXPECT_EXCEPTION( batchFilter->NormalizeTiles( inputTiles, outputTiles, 0 ) );
+  const PixelType * const expected {batchOutputs.front()->GetBufferPointer()};
+  TEST_EXPECT_TRUE( std::equal( expected, expected + tilePixels, callerOutputs.front()->GetBufferPointer() ) );
+  for( itk::SizeValueType tile {0}; tile < 2; ++tile )
+    {
+    TEST_EXPECT_TRUE( std::equal( expected, expected + tilePixels, outputTiles->GetBufferPointer() + tile * tilePixels ) );
+    }
+
+  // Without a reference there is nothing to normalize to.
+  FilterType::Pointer noReferenceFilter = FilterType::New();
+  TRY_EXPECT_EXCEPTION( noReferenceFilter->NormalizeBatch( batch ) );
+
+  std::cout << "Test finished." << std::endl;
+  return EXIT_SUCCESS;
+}
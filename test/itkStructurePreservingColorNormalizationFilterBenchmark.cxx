@@ -0,0 +1,217 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+#include "itkStructurePreservingColorNormalizationFilter.h"
+
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIterator.h"
+#include "itkMersenneTwisterRandomVariateGenerator.h"
+#include "itkMultiThreaderBase.h"
+#include "itkNormalVariateGenerator.h"
+#include "itkTestingMacros.h"
+#include "itkTimeProbe.h"
+
+namespace
+{
+
+// The stain estimates are made before BeforeThreadedGenerateData is
+// called, so the time between it and AfterThreadedGenerateData is the
+// time of the per-pixel pass alone.
+template< typename TImage >
+class PixelPassTimingFilter : public itk::StructurePreservingColorNormalizationFilter< TImage >
+{
+public:
+  ITK_DISALLOW_COPY_AND_ASSIGN( PixelPassTimingFilter );
+
+  using Self = PixelPassTimingFilter;
+  using Superclass = itk::StructurePreservingColorNormalizationFilter< TImage >;
+  using Pointer = itk::SmartPointer< Self >;
+
+  itkNewMacro( Self );
+  itkTypeMacro( PixelPassTimingFilter, StructurePreservingColorNormalizationFilter );
+
+  itk::TimeProbe &
+  GetPixelPassProbe()
+  {
+    return m_PixelPassProbe;
+  }
+
+protected:
+  PixelPassTimingFilter() = default;
+
+  void
+  BeforeThreadedGenerateData() override
+  {
+    Superclass::BeforeThreadedGenerateData();
+    m_PixelPassProbe.Start();
+  }
+
+  void
+  AfterThreadedGenerateData() override
+  {
+    m_PixelPassProbe.Stop();
+    Superclass::AfterThreadedGenerateData();
+  }
+
+private:
+  itk::TimeProbe m_PixelPassProbe;
+};
+
+
+// Fill image with random H&E-like pixels.
+template< typename TImage >
+void
+MakeStainedImage( TImage * image, itk::SizeValueType testSize, unsigned int seed )
+{
+  using PixelType = typename TImage::PixelType;
+  using FilterType = itk::StructurePreservingColorNormalizationFilter< TImage >;
+  using CalcElementType = typename FilterType::CalcElementType;
+  using CalcRowVectorType = typename FilterType::CalcRowVectorType;
+  using CalcUnaryFunctionPointer = typename FilterType::CalcUnaryFunctionPointer;
+  static constexpr unsigned int NumberOfColors = PixelType::Length;
+
+  typename TImage::SizeType size;
+  size.Fill( testSize );
+  image->SetRegions( size );
+  image->Allocate();
+
+  using UniformGeneratorType = itk::Statistics::MersenneTwisterRandomVariateGenerator;
+  typename UniformGeneratorType::Pointer uniformGenerator = UniformGeneratorType::New();
+  uniformGenerator->Initialize( seed );
+
+  using NormalGeneratorType = itk::Statistics::NormalVariateGenerator;
+  typename NormalGeneratorType::Pointer normalGenerator = NormalGeneratorType::New();
+  normalGenerator->Initialize( seed + 1 );
+
+  // White for unstained pixels, and the colors of the two stains.
+  const CalcElementType white[] {240, 240, 240};
+  const CalcElementType hematoxylin[] {16, 67, 118};
+  const CalcElementType eosin[] {199, 21, 133};
+  CalcRowVectorType logWhite {1, NumberOfColors};
+  CalcRowVectorType logHematoxylin {1, NumberOfColors};
+  CalcRowVectorType logEosin {1, NumberOfColors};
+  for( unsigned int color {0}; color < NumberOfColors; ++color )
+    {
+    logWhite( color ) = std::log( white[color] );
+    logHematoxylin( color ) = logWhite( color ) - std::log( hematoxylin[color] );
+    logEosin( color ) = logWhite( color ) - std::log( eosin[color] );
+    }
+
+  PixelType tmp;
+  for( itk::ImageRegionIterator< TImage > iter {image, image->GetLargestPossibleRegion()}; !iter.IsAtEnd(); ++iter )
+    {
+    const CalcElementType hematoxylinContribution( 0.1 * ( 1.0 / uniformGenerator->GetVariate() - 1.0 ) );
+    const CalcElementType eosinContribution( 0.1 * ( 1.0 / uniformGenerator->GetVariate() - 1.0 ) );
+    const CalcElementType noise( 5.0 * normalGenerator->GetVariate() );
+    const CalcRowVectorType randomPixelValue
+      {( logWhite - ( hematoxylinContribution * logHematoxylin ) - ( eosinContribution * logEosin ) ).unaryExpr( CalcUnaryFunctionPointer( std::exp ) ).array() + noise};
+    for( unsigned int color {0}; color < NumberOfColors; ++color )
+      {
+      tmp[color] = std::max( CalcElementType( 0.0 ), std::min( CalcElementType( 255.0 ), randomPixelValue( color ) ) );
+      }
+    iter.Set( tmp );
+    }
+}
+
+} // namespace
+
+int itkStructurePreservingColorNormalizationFilterBenchmark( int argc, char * argv[] )
+{
+  // Usage: itkStructurePreservingColorNormalizationFilterBenchmark [ imageSize [ numberOfRepetitions [ maxWorkUnits ] ] ]
+  const itk::SizeValueType testSize {argc > 1 ? static_cast< itk::SizeValueType >( std::stoul( argv[1] ) ) : 1024};
+  const unsigned int numberOfRepetitions {argc > 2 ? static_cast< unsigned int >( std::stoul( argv[2] ) ) : 3};
+  const itk::ThreadIdType maxWorkUnits {argc > 3 ? static_cast< itk::ThreadIdType >( std::stoul( argv[3] ) ) : itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads()};
+
+  constexpr unsigned int Dimension = 2;
+  using PixelType = itk::RGBPixel< unsigned char >;
+  using ImageType = itk::Image< PixelType, Dimension >; // IRGBUC2
+
+  ImageType::Pointer input = ImageType::New();
+  ImageType::Pointer refer = ImageType::New();
+  MakeStainedImage( input.GetPointer(), testSize, 20200519 );
+  MakeStainedImage( refer.GetPointer(), testSize, 20200521 );
+
+  using FilterType = PixelPassTimingFilter< ImageType >;
+  FilterType::Pointer filter = FilterType::New();
+  filter->SetInput( 0, input );   // image to be normalized using ...
+  filter->SetInput( 1, refer );   // reference image
+
+  // The output with a single work unit is what every other number of
+  // work units must reproduce.
+  ImageType::Pointer expected;
+
+  std::cout << "image size " << testSize << "x" << testSize << ", " << numberOfRepetitions << " repetitions" << std::endl;
+  std::cout << "workUnits  pixelPassSeconds  speedup" << std::endl;
+  double singleWorkUnitTime {0.0};
+  for( itk::ThreadIdType workUnits {1}; ; workUnits = std::min( 2 * workUnits, maxWorkUnits ) )
+    {
+    filter->SetNumberOfWorkUnits( workUnits );
+    filter->GetPixelPassProbe().Reset();
+    for( unsigned int repetition {0}; repetition < numberOfRepetitions; ++repetition )
+      {
+      filter->Modified();
+      TRY_EXPECT_NO_EXCEPTION( filter->Update() );
+      }
+    const double pixelPassTime {filter->GetPixelPassProbe().GetMean()};
+    if( workUnits == 1 )
+      {
+      singleWorkUnitTime = pixelPassTime;
+      }
+    std::cout << workUnits << "  " << pixelPassTime << "  " << singleWorkUnitTime / pixelPassTime << std::endl;
+
+    const ImageType * const output {filter->GetOutput()};
+    if( expected.IsNull() )
+      {
+      // Keep a copy of this output.
+      expected = ImageType::New();
+      expected->SetRegions( output->GetLargestPossibleRegion() );
+      expected->Allocate();
+      itk::ImageRegionIterator< ImageType > expectedIt {expected, expected->GetLargestPossibleRegion()};
+      itk::ImageRegionConstIterator< ImageType > outputIt {output, output->GetLargestPossibleRegion()};
+      for( ; !expectedIt.IsAtEnd(); ++expectedIt, ++outputIt )
+        {
+        expectedIt.Set( outputIt.Get() );
+        }
+      }
+    else
+      {
+      itk::ImageRegionConstIterator< ImageType > expectedIt {expected, expected->GetLargestPossibleRegion()};
+      itk::ImageRegionConstIterator< ImageType > outputIt {output, output->GetLargestPossibleRegion()};
+      for( ; !expectedIt.IsAtEnd(); ++expectedIt, ++outputIt )
+        {
+        if( expectedIt.Get() != outputIt.Get() )
+          {
+          std::cerr << "Output with " << workUnits << " work units differs from output with 1 work unit at "
+                    << outputIt.GetIndex() << std::endl;
+          return EXIT_FAILURE;
+          }
+        }
+      }
+
+    if( workUnits >= maxWorkUnits )
+      {
+      break;
+      }
+    }
+
+  std::cout << "stain estimation seconds: input " << filter->GetInputEstimationTime() << ", reference "
+            << filter->GetReferenceEstimationTime() << std::endl;
+
+  std::cout << "Test finished." << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,151 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include "itkStructurePreservingColorNormalizationFilter.h"
+
+#include "itkImageFileReader.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkTestingMacros.h"
+
+namespace
+{
+
+// The number of representable values from a to b.
+template< typename TValue >
+int
+UnitsInTheLastPlace( TValue a, TValue b )
+{
+  int units {0};
+  for( TValue value {std::min( a, b )}; value < std::max( a, b ) && units < 100; ++units )
+    {
+    value = std::nextafter( value, std::max( a, b ) );
+    }
+  return units;
+}
+
+// Check that Eigen's vectorized logarithm and exponential are within
+// TFilter::MaximumVectorizedMathULPs of std::log and std::exp, over
+// the color intensities and exponents that the pixel transform uses.
+template< typename TFilter >
+int
+CheckVectorizedMath( const char *name )
+{
+  using CalcElementType = typename TFilter::CalcElementType;
+  using ArrayType = Eigen::Array< CalcElementType, Eigen::Dynamic, 1 >;
+  constexpr Eigen::Index numberOfValues {100000};
+  ArrayType logArguments {numberOfValues};
+  ArrayType expArguments {numberOfValues};
+  for( Eigen::Index index {0}; index < numberOfValues; ++index )
+    {
+    logArguments( index ) = CalcElementType( 1.0 ) + CalcElementType( 65535.0 ) * index / numberOfValues;
+    expArguments( index ) = CalcElementType( -30.0 ) + CalcElementType( 42.0 ) * index / numberOfValues;
+    }
+  const ArrayType logValues {logArguments.log()};
+  const ArrayType expValues {expArguments.exp()};
+  int maxLogUnits {0};
+  int maxExpUnits {0};
+  for( Eigen::Index index {0}; index < numberOfValues; ++index )
+    {
+    maxLogUnits = std::max( maxLogUnits, UnitsInTheLastPlace( logValues( index ), std::log( logArguments( index ) ) ) );
+    maxExpUnits = std::max( maxExpUnits, UnitsInTheLastPlace( expValues( index ), std::exp( expArguments( index ) ) ) );
+    }
+  std::cout << name << " vectorized log and exp: within " << maxLogUnits << " and " << maxExpUnits << " ULP" << std::endl;
+  if( maxLogUnits > TFilter::MaximumVectorizedMathULPs || maxExpUnits > TFilter::MaximumVectorizedMathULPs )
+    {
+    std::cerr << name << " vectorized log or exp is not within " << TFilter::MaximumVectorizedMathULPs << " ULP" << std::endl;
+    return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}
+
+} // end anonymous namespace
+
+int itkStructurePreservingColorNormalizationFilterFloatTest( int argc, char * argv[] )
+{
+  if( argc < 3 )
+  {
+    std::cerr << "Missing parameters." << std::endl;
+    std::cerr << "Usage: " << itkNameOfTestExecutableMacro( argv );
+    std::cerr << " input0Image";
+    std::cerr << " input1Image";
+    std::cerr << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  const char * const input0ImageFileName = argv[1];
+  const char * const input1ImageFileName = argv[2];
+
+  constexpr unsigned int Dimension = 2;
+  using PixelType = itk::RGBPixel< unsigned char >;
+  static constexpr unsigned int NumberOfColors = PixelType::Length;
+  using ImageType = itk::Image< PixelType, Dimension >; // IRGBUC2
+  using DoubleFilterType = itk::StructurePreservingColorNormalizationFilter< ImageType >;
+  using FloatFilterType = itk::StructurePreservingColorNormalizationFilter< ImageType, float >;
+
+  using ReaderType = itk::ImageFileReader< ImageType >;
+  ReaderType::Pointer reader0 = ReaderType::New();
+  reader0->SetFileName( input0ImageFileName );
+  ReaderType::Pointer reader1 = ReaderType::New();
+  reader1->SetFileName( input1ImageFileName );
+
+  DoubleFilterType::Pointer doubleFilter = DoubleFilterType::New();
+  doubleFilter->SetInput( 0, reader0->GetOutput() );
+  doubleFilter->SetInput( 1, reader1->GetOutput() );
+  TRY_EXPECT_NO_EXCEPTION( doubleFilter->Update() );
+
+  FloatFilterType::Pointer floatFilter = FloatFilterType::New();
+  EXERCISE_BASIC_OBJECT_METHODS( floatFilter, StructurePreservingColorNormalizationFilter, InPlaceImageFilter );
+  floatFilter->SetInput( 0, reader0->GetOutput() );
+  floatFilter->SetInput( 1, reader1->GetOutput() );
+  TRY_EXPECT_NO_EXCEPTION( floatFilter->Update() );
+
+  // Quantify how much single precision changes the output.
+  unsigned int maxDifference {0};
+  itk::SizeValueType numberOfDifferences {0};
+  itk::SizeValueType numberOfValues {0};
+  itk::ImageRegionConstIterator< ImageType > doubleIt {doubleFilter->GetOutput(), doubleFilter->GetOutput()->GetLargestPossibleRegion()};
+  itk::ImageRegionConstIterator< ImageType > floatIt {floatFilter->GetOutput(), floatFilter->GetOutput()->GetLargestPossibleRegion()};
+  for( ; !doubleIt.IsAtEnd(); ++doubleIt, ++floatIt )
+    {
+    for( unsigned int color {0}; color < NumberOfColors; ++color )
+      {
+      const int doubleValue {doubleIt.Get()[color]};
+      const int floatValue {floatIt.Get()[color]};
+      const unsigned int difference ( std::abs( doubleValue - floatValue ) );
+      maxDifference = std::max( maxDifference, difference );
+      numberOfDifferences += difference > 0;
+      ++numberOfValues;
+      }
+    }
+  std::cout << "float versus double: " << numberOfDifferences << " of " << numberOfValues
+            << " color intensities differ, by at most " << maxDifference << std::endl;
+  TEST_EXPECT_TRUE( maxDifference <= 1 );
+  TEST_EXPECT_TRUE( numberOfDifferences * 1000 <= numberOfValues );
+
+  if( CheckVectorizedMath< DoubleFilterType >( "double" ) != EXIT_SUCCESS
+    || CheckVectorizedMath< FloatFilterType >( "float" ) != EXIT_SUCCESS )
+    {
+    return EXIT_FAILURE;
+    }
+
+  std::cout << "Test finished." << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -84,13 +84,15 @@ int itkStructurePreservingColorNormalizationFilterTest( int argc, char * argv[]
   }
 
   // Run-time test
-  if( argc < 4 )
+  if( argc < 6 )
   {
     std::cerr << "Missing parameters." << std::endl;
     std::cerr << "Usage: " << itkNameOfTestExecutableMacro( argv );
     std::cerr << " input0Image";
     std::cerr << " input1Image";
     std::cerr << " outputImage";
+    std::cerr << " streamedInputImage";
+    std::cerr << " streamedOutputImage";
     std::cerr << std::endl;
     return EXIT_FAILURE;
   }
@@ -98,6 +100,8 @@ int itkStructurePreservingColorNormalizationFilterTest( int argc, char * argv[]
   const char * const input0ImageFileName = argv[1];
   const char * const input1ImageFileName = argv[2];
   const char * const outputImageFileName = argv[3];
+  const char * const streamedInputImageFileName = argv[4];
+  const char * const streamedOutputImageFileName = argv[5];
 
   constexpr unsigned int Dimension = 2;
   using PixelType = itk::RGBPixel< unsigned char >;
@@ -109,7 +113,24 @@ int itkStructurePreservingColorNormalizationFilterTest( int argc, char * argv[]
   // filter->SetColorIndexSuppressedByHematoxylin( 0 );
   // filter->SetColorIndexSuppressedByEosin( 1 );
 
-  EXERCISE_BASIC_OBJECT_METHODS( filter, StructurePreservingColorNormalizationFilter, ImageToImageFilter );
+  EXERCISE_BASIC_OBJECT_METHODS( filter, StructurePreservingColorNormalizationFilter, InPlaceImageFilter );
+
+  // Check the estimation parameters, leaving each at its default.
+  filter->SetMaximumNumberOfSamples( 20000 );
+  TEST_SET_GET_VALUE( 20000, filter->GetMaximumNumberOfSamples() );
+  filter->SetMaximumNumberOfSamples( 100000 );
+  filter->SetMaximumNumberOfIterations( 50 );
+  TEST_SET_GET_VALUE( 50, filter->GetMaximumNumberOfIterations() );
+  filter->SetMaximumNumberOfIterations( 0 );
+  TEST_SET_GET_VALUE( 1e-2, filter->GetConvergenceThreshold() );
+  TEST_SET_GET_VALUE( 0.90, filter->GetSecondPassDistinguishersThreshold() );
+  TEST_SET_GET_VALUE( 0.80, filter->GetBrightPercentileLevel() );
+  TEST_SET_GET_VALUE( 0.50, filter->GetBrightPercentageLevel() );
+  filter->SetVeryDarkPercentileLevel( 2.0 );
+  TEST_SET_GET_VALUE( 1.0, filter->GetVeryDarkPercentileLevel() );
+  filter->SetVeryDarkPercentileLevel( 0.01 );
+  TEST_SET_GET_VALUE( 1, filter->GetNumberOfStreamDivisions() );
+  TEST_SET_GET_VALUE( 16777216, filter->GetMaximumNumberOfPixelsPerStreamDivision() );
 
   ShowProgress::Pointer showProgress = ShowProgress::New();
   filter->AddObserver( itk::ProgressEvent(), showProgress );
@@ -207,6 +228,58 @@ int itkStructurePreservingColorNormalizationFilterTest( int argc, char * argv[]
   writer->SetUseCompression( true );
 
   TRY_EXPECT_NO_EXCEPTION( writer->Update() );
+  TEST_EXPECT_EQUAL( filter->GetProgress(), 1.0f );
+
+  // An update aborted while the stains are estimated stops there, and
+  // the next update completes.
+  bool abortEstimation {true};
+  filter->AddObserver( itk::ProgressEvent(), [&filter, &abortEstimation] ( const itk::EventObject & )
+    {
+    if( abortEstimation && filter->GetProgress() > 0.0f )
+      {
+      filter->AbortGenerateDataOn();
+      }
+    } );
+  filter->SetConvergenceThreshold( 1e-3 );
+  TRY_EXPECT_EXCEPTION( filter->Update() );
+  abortEstimation = false;
+  TRY_EXPECT_NO_EXCEPTION( filter->Update() );
+  TEST_EXPECT_EQUAL( filter->GetProgress(), 1.0f );
+
+  // An image can be normalized to itself; the request for the
+  // reference image does not shrink the request for the image to be
+  // normalized.
+  const ImageType * const inputImage = filter->GetInput( 0 );
+  FilterType::Pointer toItself = FilterType::New();
+  toItself->SetInput( 0, inputImage );
+  toItself->SetInput( 1, inputImage );
+  TRY_EXPECT_NO_EXCEPTION( toItself->Update() );
+  TEST_EXPECT_EQUAL( toItself->GetOutput()->GetBufferedRegion(), inputImage->GetLargestPossibleRegion() );
+
+  // An image from a streaming reader is read in pieces to estimate
+  // its stains, and then only in the pieces that a streaming writer
+  // requests, so the reader never buffers all of it.
+  using StreamingReaderType = itk::ImageFileReader< ImageType >;
+  using StreamingWriterType = itk::ImageFileWriter< ImageType >;
+  StreamingWriterType::Pointer streamedInputWriter = StreamingWriterType::New();
+  streamedInputWriter->SetFileName( streamedInputImageFileName );
+  streamedInputWriter->SetInput( inputImage );
+  TRY_EXPECT_NO_EXCEPTION( streamedInputWriter->Update() );
+  StreamingReaderType::Pointer streamingReader = StreamingReaderType::New();
+  streamingReader->SetFileName( streamedInputImageFileName );
+  TRY_EXPECT_NO_EXCEPTION( streamingReader->UpdateOutputInformation() );
+  const ImageType::RegionType streamedRegion {streamingReader->GetOutput()->GetLargestPossibleRegion()};
+  FilterType::Pointer streamed = FilterType::New();
+  streamed->SetMaximumNumberOfPixelsPerStreamDivision( streamedRegion.GetNumberOfPixels() / 4 );
+  streamed->SetInput( 0, streamingReader->GetOutput() );
+  streamed->SetInput( 1, filter->GetInput( 1 ) );
+  StreamingWriterType::Pointer streamedOutputWriter = StreamingWriterType::New();
+  streamedOutputWriter->SetFileName( streamedOutputImageFileName );
+  streamedOutputWriter->SetInput( streamed->GetOutput() );
+  streamedOutputWriter->SetNumberOfStreamDivisions( 4 );
+  TRY_EXPECT_NO_EXCEPTION( streamedOutputWriter->Update() );
+  TEST_EXPECT_TRUE( streamingReader->GetOutput()->GetBufferedRegion().GetNumberOfPixels() < streamedRegion.GetNumberOfPixels() );
+  TEST_EXPECT_TRUE( streamed->GetInputStainModel() == toItself->GetInputStainModel() );
 
 
   std::cout << "Test finished." << std::endl;
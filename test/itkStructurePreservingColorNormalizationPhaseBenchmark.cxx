@@ -0,0 +1,266 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+#include "itkStructurePreservingColorNormalizationFilter.h"
+
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIterator.h"
+#include "itkMersenneTwisterRandomVariateGenerator.h"
+#include "itkMultiThreaderBase.h"
+#include "itkNormalVariateGenerator.h"
+#include "itkTestingMacros.h"
+#include "itkTimeProbe.h"
+#include "itkVectorImage.h"
+
+namespace
+{
+
+// The time of each phase of a stain estimate and of the pixel pass.
+struct PhaseProbes
+{
+  itk::TimeProbe sampling;        // ImageToMatrix
+  itk::TimeProbe distinguishers;  // MatrixToDistinguishers
+  itk::TimeProbe factorization;   // HALSNMFEuclidean or VirtanenNMFEuclidean
+  itk::TimeProbe normalization;   // NormalizeMatrixH
+  itk::TimeProbe pixelPass;       // NMFsToImage
+};
+
+
+// Run the phases of the filter one at a time, timing each.  The image
+// is normalized to itself, which costs what normalizing it to any
+// other reference costs.
+template< typename TImage >
+class PhaseTimingFilter : public itk::StructurePreservingColorNormalizationFilter< TImage >
+{
+public:
+  ITK_DISALLOW_COPY_AND_ASSIGN( PhaseTimingFilter );
+
+  using Self = PhaseTimingFilter;
+  using Superclass = itk::StructurePreservingColorNormalizationFilter< TImage >;
+  using Pointer = itk::SmartPointer< Self >;
+  using ImageType = TImage;
+  using RegionType = typename Superclass::RegionType;
+  using RegionIterator = typename Superclass::RegionIterator;
+  using CalcMatrixType = typename Superclass::CalcMatrixType;
+  using CalcMatrixConstRefType = typename Superclass::CalcMatrixConstRefType;
+  using CalcRowVectorType = typename Superclass::CalcRowVectorType;
+  using SampleMatrix = typename Superclass::SampleMatrix;
+  using TransformModel = typename Superclass::TransformModel;
+
+  itkNewMacro( Self );
+  itkTypeMacro( PhaseTimingFilter, StructurePreservingColorNormalizationFilter );
+
+  void
+  TimePhases( ImageType * image, PhaseProbes & probes )
+  {
+    this->ValidateParameters();
+    if /*constexpr*/( Superclass::template PixelHelper< typename ImageType::PixelType >::NumberOfDimensions < 0 )
+      {
+      this->m_NumberOfDimensions = image->GetNumberOfComponentsPerPixel();
+      this->m_NumberOfColors = this->m_NumberOfDimensions;
+      }
+
+    SampleMatrix samples;
+    probes.sampling.Start();
+    this->ImageToMatrix( image, samples );
+    probes.sampling.Stop();
+    const CalcMatrixConstRefType matrixBrightV {samples.matrixV.bottomRows( samples.matrixV.rows() - samples.firstBrightRow )};
+    const CalcMatrixConstRefType matrixDarkV {samples.matrixV.topRows( samples.endOfDarkRows )};
+
+    CalcMatrixType distinguishers;
+    probes.distinguishers.Start();
+    this->MatrixToDistinguishers( matrixBrightV, distinguishers );
+    probes.distinguishers.Stop();
+
+    CalcMatrixType matrixH;
+    CalcRowVectorType unstainedPixel {1, this->m_NumberOfColors};
+    itkAssertOrThrowMacro( this->DistinguishersToNMFSeeds( distinguishers, unstainedPixel, matrixH ) == 0, "The synthetic image has no distinct stains" );
+
+    const itk::MultiThreaderBase::Pointer estimationMultiThreader {this->NewEstimationMultiThreader()};
+    CalcMatrixType matrixW;
+    probes.factorization.Start();
+    if( this->GetUseMultiplicativeUpdates() )
+      {
+      this->VirtanenNMFEuclidean( matrixBrightV, matrixW, matrixH, nullptr, estimationMultiThreader );
+      }
+    else
+      {
+      this->HALSNMFEuclidean( matrixBrightV, matrixW, matrixH, nullptr, estimationMultiThreader );
+      }
+    probes.factorization.Stop();
+
+    probes.normalization.Start();
+    this->NormalizeMatrixH( matrixDarkV, unstainedPixel, matrixH, estimationMultiThreader );
+    probes.normalization.Stop();
+
+    // The pixel pass, divided among the work units as the pipeline
+    // divides it.
+    TransformModel model;
+    this->NMFsToTransformModel( matrixH, unstainedPixel, matrixH, unstainedPixel, model );
+    this->BuildLookupTables();
+    const typename ImageType::Pointer outputImage {ImageType::New()};
+    outputImage->SetRegions( image->GetLargestPossibleRegion() );
+    outputImage->SetNumberOfComponentsPerPixel( image->GetNumberOfComponentsPerPixel() );
+    outputImage->Allocate();
+    itk::MultiThreaderBase * const multiThreader {this->GetMultiThreader()};
+    multiThreader->SetNumberOfWorkUnits( this->GetNumberOfWorkUnits() );
+    probes.pixelPass.Start();
+    multiThreader->template ParallelizeImageRegion< ImageType::ImageDimension >( outputImage->GetLargestPossibleRegion(),
+      [this, image, &outputImage, &model] ( const RegionType & region )
+      {
+      RegionIterator outIt {outputImage, region};
+      this->NMFsToImage( image, model, outIt );
+      }, nullptr );
+    probes.pixelPass.Stop();
+  }
+
+protected:
+  PhaseTimingFilter() = default;
+};
+
+
+// Make an image of random H&E-like pixels, each color intensity
+// scaled from [0, 255] to [0, 255 * scale].  Any values beyond the
+// colors, such as alpha, are set to their maximum.
+template< typename TImage >
+typename TImage::Pointer
+MakeStainedImage( itk::SizeValueType testSize, unsigned int numberOfDimensions, double scale, unsigned int seed )
+{
+  using PixelType = typename TImage::PixelType;
+  using ValueType = typename itk::NumericTraits< PixelType >::ValueType;
+  constexpr unsigned int NumberOfColors {3};
+
+  const typename TImage::Pointer image {TImage::New()};
+  typename TImage::SizeType size;
+  size.Fill( testSize );
+  image->SetRegions( size );
+  image->SetNumberOfComponentsPerPixel( numberOfDimensions );
+  image->Allocate();
+
+  using UniformGeneratorType = itk::Statistics::MersenneTwisterRandomVariateGenerator;
+  typename UniformGeneratorType::Pointer uniformGenerator = UniformGeneratorType::New();
+  uniformGenerator->Initialize( seed );
+
+  using NormalGeneratorType = itk::Statistics::NormalVariateGenerator;
+  typename NormalGeneratorType::Pointer normalGenerator = NormalGeneratorType::New();
+  normalGenerator->Initialize( seed + 1 );
+
+  // White for unstained pixels, and the colors of the two stains.
+  const double white[] {240, 240, 240};
+  const double hematoxylin[] {16, 67, 118};
+  const double eosin[] {199, 21, 133};
+  double logHematoxylin[NumberOfColors];
+  double logEosin[NumberOfColors];
+  for( unsigned int color {0}; color < NumberOfColors; ++color )
+    {
+    logHematoxylin[color] = std::log( white[color] ) - std::log( hematoxylin[color] );
+    logEosin[color] = std::log( white[color] ) - std::log( eosin[color] );
+    }
+
+  PixelType pixel;
+  itk::NumericTraits< PixelType >::SetLength( pixel, numberOfDimensions );
+  for( unsigned int dim {NumberOfColors}; dim < numberOfDimensions; ++dim )
+    {
+    pixel[dim] = itk::NumericTraits< ValueType >::max();
+    }
+  for( itk::ImageRegionIterator< TImage > iter {image, image->GetLargestPossibleRegion()}; !iter.IsAtEnd(); ++iter )
+    {
+    const double hematoxylinContribution {0.1 * ( 1.0 / uniformGenerator->GetVariate() - 1.0 )};
+    const double eosinContribution {0.1 * ( 1.0 / uniformGenerator->GetVariate() - 1.0 )};
+    const double noise {5.0 * normalGenerator->GetVariate()};
+    for( unsigned int color {0}; color < NumberOfColors; ++color )
+      {
+      const double value {white[color] * std::exp( -hematoxylinContribution * logHematoxylin[color] - eosinContribution * logEosin[color] ) + noise};
+      pixel[color] = static_cast< ValueType >( scale * std::max( 0.0, std::min( 255.0, value ) ) );
+      }
+    iter.Set( pixel );
+    }
+  return image;
+}
+
+
+// Time each phase for images of the given sizes and for numbers of
+// work units doubling up to maxWorkUnits.
+template< typename TImage >
+int
+BenchmarkPixelType( const char * pixelTypeName, unsigned int numberOfDimensions, double scale,
+  const std::vector< itk::SizeValueType > & sizes, unsigned int numberOfRepetitions, itk::ThreadIdType maxWorkUnits )
+{
+  using FilterType = PhaseTimingFilter< TImage >;
+  typename FilterType::Pointer filter = FilterType::New();
+  filter->SetColorIndexSuppressedByHematoxylin( 0 );
+  filter->SetColorIndexSuppressedByEosin( 1 );
+
+  for( const itk::SizeValueType testSize : sizes )
+    {
+    const typename TImage::Pointer image {MakeStainedImage< TImage >( testSize, numberOfDimensions, scale, 20200519 )};
+    const double megapixels {testSize * testSize * 1e-6};
+    for( itk::ThreadIdType workUnits {1}; ; workUnits = std::min( 2 * workUnits, maxWorkUnits ) )
+      {
+      filter->SetNumberOfWorkUnits( workUnits );
+      PhaseProbes probes;
+      for( unsigned int repetition {0}; repetition < numberOfRepetitions; ++repetition )
+        {
+        TRY_EXPECT_NO_EXCEPTION( filter->TimePhases( image, probes ) );
+        }
+      std::cout << pixelTypeName << "  " << megapixels << "  " << workUnits
+                << "  " << probes.sampling.GetMean()
+                << "  " << probes.distinguishers.GetMean()
+                << "  " << probes.factorization.GetMean()
+                << "  " << probes.normalization.GetMean()
+                << "  " << probes.pixelPass.GetMean()
+                << "  " << megapixels / probes.pixelPass.GetMean() << std::endl;
+      if( workUnits >= maxWorkUnits )
+        {
+        break;
+        }
+      }
+    }
+  return EXIT_SUCCESS;
+}
+
+} // namespace
+
+int itkStructurePreservingColorNormalizationPhaseBenchmark( int argc, char * argv[] )
+{
+  // Usage: itkStructurePreservingColorNormalizationPhaseBenchmark [ maxImageSize [ numberOfRepetitions [ maxWorkUnits ] ] ]
+  //
+  // The image sizes double from 1024x1024 (1 MP), or from maxImageSize
+  // if that is smaller, up to maxImageSize; 32768 reaches 1 GP.
+  const itk::SizeValueType maxSize {argc > 1 ? static_cast< itk::SizeValueType >( std::stoul( argv[1] ) ) : 1024};
+  const unsigned int numberOfRepetitions {argc > 2 ? static_cast< unsigned int >( std::stoul( argv[2] ) ) : 3};
+  const itk::ThreadIdType maxWorkUnits {argc > 3 ? static_cast< itk::ThreadIdType >( std::stoul( argv[3] ) ) : itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads()};
+  std::vector< itk::SizeValueType > sizes;
+  for( itk::SizeValueType size {std::min( maxSize, itk::SizeValueType {1024} )}; size <= maxSize; size *= 2 )
+    {
+    sizes.push_back( size );
+    }
+
+  constexpr unsigned int Dimension = 2;
+  std::cout << numberOfRepetitions << " repetitions; mean seconds per phase" << std::endl;
+  std::cout << "pixelType  megapixels  workUnits  sampling  distinguishers  factorization  normalization  pixelPass  pixelPassMegapixelsPerSecond" << std::endl;
+  if( BenchmarkPixelType< itk::Image< itk::RGBPixel< unsigned char >, Dimension > >( "RGBUC", 3, 1.0, sizes, numberOfRepetitions, maxWorkUnits ) != EXIT_SUCCESS
+    || BenchmarkPixelType< itk::Image< itk::RGBAPixel< unsigned short >, Dimension > >( "RGBAUS", 4, 257.0, sizes, numberOfRepetitions, maxWorkUnits ) != EXIT_SUCCESS
+    || BenchmarkPixelType< itk::VectorImage< float, Dimension > >( "VF3", 3, 1.0, sizes, numberOfRepetitions, maxWorkUnits ) != EXIT_SUCCESS )
+    {
+    return EXIT_FAILURE;
+    }
+
+  std::cout << "Test finished." << std::endl;
+  return EXIT_SUCCESS;
+}
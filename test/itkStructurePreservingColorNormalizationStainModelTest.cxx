@@ -0,0 +1,346 @@
+/*=========================================================================
+ *
+ *  Copyright NumFOCUS
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+#include <algorithm>
+#include <clocale>
+#include <cmath>
+#include <limits>
+#include "itkStructurePreservingColorNormalizationFilter.h"
+#include "itkStructurePreservingColorNormalizationStainModel.h"
+
+#include "itkImageFileReader.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkTestingMacros.h"
+
+int itkStructurePreservingColorNormalizationStainModelTest( int argc, char * argv[] )
+{
+  if( argc < 4 )
+  {
+    std::cerr << "Missing parameters." << std::endl;
+    std::cerr << "Usage: " << itkNameOfTestExecutableMacro( argv );
+    std::cerr << " input0Image";
+    std::cerr << " input1Image";
+    std::cerr << " outputStainModel";
+    std::cerr << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  const char * const input0ImageFileName = argv[1];
+  const char * const input1ImageFileName = argv[2];
+  const char * const outputStainModelFileName = argv[3];
+
+  constexpr unsigned int Dimension = 2;
+  using PixelType = itk::RGBPixel< unsigned char >;
+  using ImageType = itk::Image< PixelType, Dimension >; // IRGBUC2
+  using FilterType = itk::StructurePreservingColorNormalizationFilter< ImageType >;
+  using StainModelType = FilterType::StainModelType;
+
+  using ReaderType = itk::ImageFileReader< ImageType >;
+  ReaderType::Pointer reader0 = ReaderType::New();
+  reader0->SetFileName( input0ImageFileName );
+  ReaderType::Pointer reader1 = ReaderType::New();
+  reader1->SetFileName( input1ImageFileName );
+
+  // Estimate the reference stain model from the reference image.
+  FilterType::Pointer fromImage = FilterType::New();
+  fromImage->SetInput( 0, reader0->GetOutput() );
+  fromImage->SetInput( 1, reader1->GetOutput() );
+  TRY_EXPECT_NO_EXCEPTION( fromImage->Update() );
+  const StainModelType referenceModel {fromImage->GetReferenceStainModel()};
+  TEST_EXPECT_EQUAL( referenceModel.GetNumberOfStains(), 2 );
+  TEST_EXPECT_EQUAL( referenceModel.GetNumberOfColors(), 3 );
+
+  // Writing and reading reproduces the model exactly.
+  TRY_EXPECT_NO_EXCEPTION( referenceModel.WriteJSON( outputStainModelFileName ) );
+  StainModelType readModel;
+  TEST_EXPECT_TRUE( readModel.IsEmpty() );
+  TRY_EXPECT_NO_EXCEPTION( readModel.ReadJSON( outputStainModelFileName ) );
+  TEST_EXPECT_TRUE( readModel == referenceModel );
+
+  std::istringstream malformed {"{ \"unstainedPixel\": [ 1, 2, 3 ], \"matrixH\": [ [ 1, 2 ] ] }"};
+  TRY_EXPECT_EXCEPTION( readModel.ReadJSON( malformed ) );
+
+  // Only JSON numbers are read, and a model needs colors.
+  for( const char * const notJSON : {"{ \"unstainedPixel\": [ nan, 2, 3 ], \"matrixH\": [] }",
+    "{ \"unstainedPixel\": [ inf, 2, 3 ], \"matrixH\": [] }",
+    "{ \"unstainedPixel\": [ 0x1p3, 2, 3 ], \"matrixH\": [] }",
+    "{ \"unstainedPixel\": [], \"matrixH\": [] }"} )
+    {
+    std::istringstream notJSONStream {notJSON};
+    TRY_EXPECT_EXCEPTION( readModel.ReadJSON( notJSONStream ) );
+    }
+
+  // A model that is not finite is not written.
+  const StainModelType notFinite {referenceModel.GetMatrixH() * std::numeric_limits< double >::quiet_NaN(), referenceModel.GetUnstainedPixel()};
+  std::ostringstream notFiniteStream;
+  TRY_EXPECT_EXCEPTION( notFinite.WriteJSON( notFiniteStream ) );
+
+  // The model reads back the same under a locale with a decimal comma,
+  // when one is installed.
+  if( std::setlocale( LC_ALL, "de_DE.UTF-8" ) != nullptr )
+    {
+    StainModelType localeModel;
+    TRY_EXPECT_NO_EXCEPTION( localeModel.ReadJSON( outputStainModelFileName ) );
+    std::setlocale( LC_ALL, "C" );
+    TEST_EXPECT_TRUE( localeModel == referenceModel );
+    }
+
+  // Wrapped languages pass the models as JSON documents.
+  FilterType::Pointer fromJSON = FilterType::New();
+  TRY_EXPECT_NO_EXCEPTION( fromJSON->SetReferenceStainModelJSON( fromImage->GetReferenceStainModelJSON() ) );
+  TEST_EXPECT_TRUE( fromJSON->GetReferenceStainModel() == referenceModel );
+  TRY_EXPECT_EXCEPTION( fromJSON->SetInputStainModelJSON( "{}" ) );
+
+  // A filter given the model instead of a reference image produces
+  // the same output.
+  FilterType::Pointer fromModel = FilterType::New();
+  fromModel->SetInput( 0, reader0->GetOutput() );
+  fromModel->SetReferenceStainModel( readModel );
+  TRY_EXPECT_NO_EXCEPTION( fromModel->Update() );
+  TEST_EXPECT_TRUE( fromModel->GetInputStainModel() == fromImage->GetInputStainModel() );
+
+  itk::ImageRegionConstIterator< ImageType > fromImageIt {fromImage->GetOutput(), fromImage->GetOutput()->GetLargestPossibleRegion()};
+  itk::ImageRegionConstIterator< ImageType > fromModelIt {fromModel->GetOutput(), fromModel->GetOutput()->GetLargestPossibleRegion()};
+  for( ; !fromImageIt.IsAtEnd(); ++fromImageIt, ++fromModelIt )
+    {
+    if( fromImageIt.Get() != fromModelIt.Get() )
+      {
+      std::cerr << "Output from the stain model differs from output from the reference image at "
+                << fromModelIt.GetIndex() << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  // An input stain model estimated once, as for a whole slide, is
+  // applied as is to the image to be normalized.
+  FilterType::Pointer fromModels = FilterType::New();
+  StainModelType inputModel;
+  TRY_EXPECT_NO_EXCEPTION( inputModel = fromModels->EstimateStainModel( reader0->GetOutput() ) );
+  TEST_EXPECT_TRUE( inputModel == fromImage->GetInputStainModel() );
+
+  // The estimate does not depend upon the number of work units.
+  FilterType::Pointer oneWorkUnit = FilterType::New();
+  oneWorkUnit->SetNumberOfWorkUnits( 1 );
+  TEST_EXPECT_TRUE( oneWorkUnit->EstimateStainModel( reader0->GetOutput() ) == inputModel );
+  fromModels->SetInput( 0, reader0->GetOutput() );
+  fromModels->SetInputStainModel( inputModel );
+  fromModels->SetReferenceStainModel( referenceModel );
+  TRY_EXPECT_NO_EXCEPTION( fromModels->Update() );
+  TEST_EXPECT_EQUAL( fromModels->GetInputEstimationTime(), 0.0 );
+  TEST_EXPECT_EQUAL( fromModels->GetReferenceEstimationTime(), 0.0 );
+  itk::ImageRegionConstIterator< ImageType > fromModelsIt {fromModels->GetOutput(), fromModels->GetOutput()->GetLargestPossibleRegion()};
+  for( fromImageIt.GoToBegin(); !fromImageIt.IsAtEnd(); ++fromImageIt, ++fromModelsIt )
+    {
+    if( fromImageIt.Get() != fromModelsIt.Get() )
+      {
+      std::cerr << "Output from the stain models differs from output from the images at "
+                << fromModelsIt.GetIndex() << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  // The exported coefficients, applied as documented, reproduce the
+  // transform, up to rounding of std::exp at an integer boundary.
+  // They are known from the stain models alone, without an update.
+  using CoefficientsType = FilterType::PixelTransformCoefficients;
+  TEST_EXPECT_TRUE( FilterType::New()->GetPixelTransformCoefficients().referenceH.empty() );
+  const CoefficientsType coefficients {fromModels->GetPixelTransformCoefficients()};
+  FilterType::Pointer coefficientsOnly = FilterType::New();
+  coefficientsOnly->SetInputStainModel( inputModel );
+  coefficientsOnly->SetReferenceStainModel( referenceModel );
+  TEST_EXPECT_TRUE( coefficientsOnly->GetPixelTransformCoefficients().referenceH == coefficients.referenceH );
+  TEST_EXPECT_EQUAL( coefficients.numberOfColors, 3 );
+  TEST_EXPECT_EQUAL( coefficients.numberOfStains, 2 );
+  const itk::SizeValueType numberOfColors {coefficients.numberOfColors};
+  const itk::SizeValueType numberOfStains {coefficients.numberOfStains};
+  itk::ImageRegionConstIterator< ImageType > inputIt {reader0->GetOutput(), reader0->GetOutput()->GetLargestPossibleRegion()};
+  for( inputIt.GoToBegin(), fromModelsIt.GoToBegin(); !inputIt.IsAtEnd(); ++inputIt, ++fromModelsIt )
+    {
+    // The logarithm of a zero color is not finite, so such a pixel
+    // is left out.
+    const PixelType inputPixel {inputIt.Get()};
+    if( inputPixel[0] == 0 || inputPixel[1] == 0 || inputPixel[2] == 0 )
+      {
+      continue;
+      }
+    double d[3], p[2], w[2];
+    for( itk::SizeValueType color {0}; color < numberOfColors; ++color )
+      {
+      d[color] = coefficients.logInputUnstained[color] - std::log( static_cast< double >( inputPixel[color] ) );
+      }
+    for( itk::SizeValueType stain {0}; stain < numberOfStains; ++stain )
+      {
+      p[stain] = -FilterType::lambda;
+      for( itk::SizeValueType color {0}; color < numberOfColors; ++color )
+        {
+        p[stain] += d[color] * coefficients.inputHTranspose[color * numberOfStains + stain];
+        }
+      p[stain] = std::max( p[stain], 0.0 );
+      }
+    for( itk::SizeValueType stain {0}; stain < numberOfStains; ++stain )
+      {
+      w[stain] = 0.0;
+      for( itk::SizeValueType other {0}; other < numberOfStains; ++other )
+        {
+        w[stain] += p[other] * coefficients.inputHHTransposeInverse[other * numberOfStains + stain];
+        }
+      w[stain] = std::max( w[stain], 0.0 );
+      }
+    for( itk::SizeValueType color {0}; color < numberOfColors; ++color )
+      {
+      double y {coefficients.logReferenceUnstained[color]};
+      for( itk::SizeValueType stain {0}; stain < numberOfStains; ++stain )
+        {
+        y -= w[stain] * coefficients.referenceH[stain * numberOfColors + color];
+        }
+      const int expected {static_cast< int >( std::min( std::max( std::exp( y ) - 1.0, coefficients.lowerbound ), coefficients.upperbound ) )};
+      if( std::abs( expected - static_cast< int >( fromModelsIt.Get()[color] ) ) > 1 )
+        {
+        std::cerr << "The exported transform coefficients do not reproduce the output at "
+                  << fromModelsIt.GetIndex() << std::endl;
+        return EXIT_FAILURE;
+        }
+      }
+    }
+
+  // A color lookup table of every color reproduces the transform
+  // exactly, and a coarse grid interpolates it closely.
+  fromModels->UseColorLookupTableOn();
+  TRY_EXPECT_NO_EXCEPTION( fromModels->Update() );
+  for( fromImageIt.GoToBegin(), fromModelsIt.GoToBegin(); !fromImageIt.IsAtEnd(); ++fromImageIt, ++fromModelsIt )
+    {
+    if( fromImageIt.Get() != fromModelsIt.Get() )
+      {
+      std::cerr << "Output from the color lookup table differs from output from the images at "
+                << fromModelsIt.GetIndex() << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+  fromModels->SetColorLookupTableSize( 33 );
+  TRY_EXPECT_NO_EXCEPTION( fromModels->Update() );
+  int maxDifference {0};
+  double sumOfDifferences {0.0};
+  double numberOfValues {0.0};
+  for( fromImageIt.GoToBegin(), fromModelsIt.GoToBegin(); !fromImageIt.IsAtEnd(); ++fromImageIt, ++fromModelsIt )
+    {
+    for( unsigned int color {0}; color < 3; ++color )
+      {
+      const int difference {std::abs( int {fromImageIt.Get()[color]} - int {fromModelsIt.Get()[color]} )};
+      maxDifference = std::max( maxDifference, difference );
+      sumOfDifferences += difference;
+      ++numberOfValues;
+      }
+    }
+  std::cout << "33^3 color lookup table: color intensities differ by " << sumOfDifferences / numberOfValues
+            << " on average and by at most " << maxDifference << std::endl;
+  TEST_EXPECT_TRUE( sumOfDifferences <= numberOfValues );
+
+  // Background pixels are written without being transformed, and a
+  // lower threshold skips more of them.
+  fromModels->UseColorLookupTableOff();
+  fromModels->SkipBackgroundOn();
+  TRY_EXPECT_NO_EXCEPTION( fromModels->Update() );
+  const itk::SizeValueType numberOfUnstainedPixels {fromModels->GetNumberOfBackgroundPixels()};
+  maxDifference = 0;
+  for( fromImageIt.GoToBegin(), fromModelsIt.GoToBegin(); !fromImageIt.IsAtEnd(); ++fromImageIt, ++fromModelsIt )
+    {
+    for( unsigned int color {0}; color < 3; ++color )
+      {
+      maxDifference = std::max( maxDifference, std::abs( int {fromImageIt.Get()[color]} - int {fromModelsIt.Get()[color]} ) );
+      }
+    }
+  TEST_EXPECT_TRUE( maxDifference <= 1 );
+  fromModels->SetBackgroundThreshold( 0.9 );
+  TRY_EXPECT_NO_EXCEPTION( fromModels->Update() );
+  std::cout << "Background pixels: " << numberOfUnstainedPixels << " unstained, " << fromModels->GetNumberOfBackgroundPixels()
+            << " at threshold 0.9" << std::endl;
+  TEST_EXPECT_TRUE( fromModels->GetNumberOfBackgroundPixels() > 0 );
+  TEST_EXPECT_TRUE( fromModels->GetNumberOfBackgroundPixels() >= numberOfUnstainedPixels );
+  fromModels->SkipBackgroundOff();
+
+  // A change to an estimation parameter discards the cached
+  // estimates, so both images are estimated anew.  Each phase is
+  // measured.
+  unsigned int numberOfStatisticsEvents {0};
+  fromImage->AddObserver( itk::StructurePreservingColorNormalizationStatisticsEvent(),
+    [&numberOfStatisticsEvents] ( const itk::EventObject & ) { ++numberOfStatisticsEvents; } );
+  fromImage->MeasurePhasesOn();
+  fromImage->SetMaximumNumberOfIterations( 100 );
+  TRY_EXPECT_NO_EXCEPTION( fromImage->Update() );
+  TEST_EXPECT_EQUAL( numberOfStatisticsEvents, 1u );
+  const FilterType::PhaseStatistics &statistics {fromImage->GetPhaseStatistics()};
+  TEST_EXPECT_TRUE( !statistics.input.cached && !statistics.reference.cached );
+  TEST_EXPECT_TRUE( statistics.reference.numberOfSamples > 0 );
+  TEST_EXPECT_EQUAL( statistics.reference.sampleBytes, statistics.reference.numberOfSamples * 3 * sizeof( double ) );
+  TEST_EXPECT_TRUE( statistics.reference.numberOfBrightSamples <= statistics.reference.numberOfSamples );
+  TEST_EXPECT_EQUAL( statistics.reference.numberOfIterations, fromImage->GetReferenceNumberOfIterations() );
+  TEST_EXPECT_TRUE( statistics.reference.samplingTime > 0.0 );
+  TEST_EXPECT_TRUE( statistics.pixelPassTime > 0.0 );
+  fromImage->MeasurePhasesOff();
+  TEST_EXPECT_TRUE( fromImage->GetInputEstimationTime() > 0.0 );
+  TEST_EXPECT_TRUE( fromImage->GetReferenceEstimationTime() > 0.0 );
+  TEST_EXPECT_TRUE( fromImage->GetReferenceStainModel() != referenceModel );
+  TEST_EXPECT_TRUE( fromImage->GetReferenceNumberOfIterations() > 0 );
+  TEST_EXPECT_TRUE( fromImage->GetReferenceNumberOfIterations() <= 100 );
+
+  // Virtanen's multiplicative updates refine the estimate too.
+  const StainModelType halsModel {fromImage->GetReferenceStainModel()};
+  fromImage->UseMultiplicativeUpdatesOn();
+  TRY_EXPECT_NO_EXCEPTION( fromImage->Update() );
+  TEST_EXPECT_TRUE( fromImage->GetReferenceStainModel() != halsModel );
+  TEST_EXPECT_TRUE( fromImage->GetReferenceNumberOfIterations() > 0 );
+
+  fromModel->ClearReferenceStainModel();
+  TRY_EXPECT_EXCEPTION( fromModel->Update() );
+
+  // Filters that share the reference cache estimate the reference
+  // image's stain model once among them, for each set of estimation
+  // parameters.
+  using ModelCacheType = itk::StructurePreservingColorNormalizationModelCache;
+  ModelCacheType::Clear();
+  FilterType::Pointer firstShared = FilterType::New();
+  firstShared->UseSharedReferenceCacheOn();
+  firstShared->MeasurePhasesOn();
+  firstShared->SetInput( 0, reader0->GetOutput() );
+  firstShared->SetInput( 1, reader1->GetOutput() );
+  TRY_EXPECT_NO_EXCEPTION( firstShared->Update() );
+  TEST_EXPECT_TRUE( !firstShared->GetPhaseStatistics().reference.cached );
+  TEST_EXPECT_TRUE( firstShared->GetReferenceStainModel() == referenceModel );
+  TEST_EXPECT_EQUAL( ModelCacheType::GetNumberOfModels(), 1u );
+  FilterType::Pointer secondShared = FilterType::New();
+  secondShared->UseSharedReferenceCacheOn();
+  secondShared->MeasurePhasesOn();
+  secondShared->SetInput( 0, reader0->GetOutput() );
+  secondShared->SetInput( 1, reader1->GetOutput() );
+  TRY_EXPECT_NO_EXCEPTION( secondShared->Update() );
+  TEST_EXPECT_TRUE( secondShared->GetPhaseStatistics().reference.cached );
+  TEST_EXPECT_TRUE( secondShared->GetReferenceStainModel() == referenceModel );
+  // Other estimation parameters are another entry of the cache.
+  secondShared->SetMaximumNumberOfIterations( 100 );
+  TRY_EXPECT_NO_EXCEPTION( secondShared->Update() );
+  TEST_EXPECT_TRUE( !secondShared->GetPhaseStatistics().reference.cached );
+  TEST_EXPECT_TRUE( secondShared->GetReferenceNumberOfIterations() > 0 );
+  TEST_EXPECT_EQUAL( ModelCacheType::GetNumberOfModels(), 2u );
+  ModelCacheType::SetMaximumNumberOfModels( 1 );
+  TEST_EXPECT_EQUAL( ModelCacheType::GetNumberOfModels(), 1u );
+  ModelCacheType::SetMaximumNumberOfModels( 8 );
+  ModelCacheType::Clear();
+
+  std::cout << "Test finished." << std::endl;
+  return EXIT_SUCCESS;
+}
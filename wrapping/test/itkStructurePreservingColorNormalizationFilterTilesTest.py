@@ -0,0 +1,73 @@
+#==========================================================================
+#
+#   Copyright NumFOCUS
+#
+#   Licensed under the Apache License, Version 2.0 (the "License");
+#   you may not use this file except in compliance with the License.
+#   You may obtain a copy of the License at
+#
+#          http://www.apache.org/licenses/LICENSE-2.0.txt
+#
+#   Unless required by applicable law or agreed to in writing, software
+#   distributed under the License is distributed on an "AS IS" BASIS,
+#   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#   See the License for the specific language governing permissions and
+#   limitations under the License.
+#
+#==========================================================================*/
+
+# Normalize a stack of NumPy tiles in place, as the README describes,
+# and check the result against normalizing each tile by itself.
+
+import sys
+
+import itk
+import numpy as np
+
+if len(sys.argv) < 3:
+    print("Usage: " + sys.argv[0] + " input_image reference_image")
+    sys.exit(1)
+
+ImageType = itk.Image[itk.RGBPixel[itk.UC], 2]
+FilterType = itk.StructurePreservingColorNormalizationFilter[ImageType]
+
+reference_image = itk.imread(sys.argv[2], pixel_type=itk.RGBPixel[itk.UC])
+tile = itk.array_from_image(itk.imread(sys.argv[1], pixel_type=itk.RGBPixel[itk.UC]))
+
+# Three tiles of the same size that differ from one another.
+tiles = np.ascontiguousarray(np.stack([tile, tile[::-1], tile[:, ::-1]]))
+assert tiles.shape[3] == 3 and tiles.dtype == np.uint8
+original_tiles = tiles.copy()
+normalized_tiles = np.empty_like(tiles)
+input_view = itk.image_view_from_array(tiles.reshape(-1, tiles.shape[2], 3), ttype=ImageType)
+output_view = itk.image_view_from_array(normalized_tiles.reshape(-1, tiles.shape[2], 3), ttype=ImageType)
+
+spcn_filter = FilterType.New()
+spcn_filter.SetInput(1, reference_image)
+spcn_filter.NormalizeTiles(input_view, output_view, tiles.shape[0])
+
+# The output was written into the caller's array, and the input array
+# was left alone.
+assert np.array_equal(tiles, original_tiles)
+assert not np.array_equal(normalized_tiles, tiles)
+for index in range(tiles.shape[0]):
+    tile_filter = FilterType.New()
+    tile_filter.SetInput(0, itk.image_from_array(tiles[index], ttype=ImageType))
+    tile_filter.SetInput(1, reference_image)
+    tile_filter.Update()
+    expected = itk.array_from_image(tile_filter.GetOutput())
+    difference = np.abs(expected.astype(np.int16) - normalized_tiles[index].astype(np.int16))
+    assert difference.max() <= 1, "tile " + str(index) + " differs by " + str(difference.max())
+
+# A stain model survives a round trip through JSON, and stands in for
+# the reference image.
+reference_model = spcn_filter.GetReferenceStainModelJSON()
+model_filter = FilterType.New()
+model_filter.SetReferenceStainModelJSON(reference_model)
+assert model_filter.GetReferenceStainModelJSON() == reference_model
+model_tiles = np.empty_like(tiles)
+model_view = itk.image_view_from_array(model_tiles.reshape(-1, tiles.shape[2], 3), ttype=ImageType)
+model_filter.NormalizeTiles(input_view, model_view, tiles.shape[0])
+assert np.array_equal(model_tiles, normalized_tiles)
+
+print("Test finished.")